@@ -4,6 +4,7 @@
 // SPDX-License-Identifier: GPL-3.0-only
 
 #include <algorithm>
+#include <bit>
 #include <chrono>
 #include <cstring>
 #include <format>
@@ -23,19 +24,16 @@ namespace Apex
   {
   }
 
-  Filename::Filename():
-    name(FILENAME_CHARS, ' '),
-    ext(EXTENSION_CHARS, ' '),
-    m_has_wildcard(false)
+  Filename::Filename()
   {
+    m_chars.fill(' ');
   }
 
-  Filename::Filename(const std::string& pattern):
-    name(FILENAME_CHARS, ' '),
-    ext(EXTENSION_CHARS, ' '),
-    m_has_wildcard(false)
+  Filename::Filename(std::string_view pattern)
   {
-    std::vector<char>* current_part = &name;
+    m_chars.fill(' ');
+    std::size_t part_offset = 0;
+    std::size_t part_size = FILENAME_CHARS;
     unsigned index = 0;
     bool have_star = false;
     for (const char c: pattern)
@@ -46,7 +44,7 @@ namespace Apex
 	  (c == '?') ||
 	  (c == '*'))
       {
-	if (index >= current_part->size())
+	if (index >= part_size)
 	{
 	  throw FilenameError("filename component too long");
 	}
@@ -54,15 +52,15 @@ namespace Apex
 	{
 	  throw FilenameError("filename component has characters after star");
 	}
-	(*current_part)[index++] = c;
-	m_has_wildcard |= ((c == '?') || (c == '*'));
+	m_chars[part_offset + index++] = c;
 	have_star = (c == '*');
       }
       else if (c == '.')
       {
-	if (current_part == &name)
+	if (part_offset == 0)
 	{
-	  current_part = &ext;
+	  part_offset = FILENAME_CHARS;
+	  part_size = EXTENSION_CHARS;
 	  index = 0;
 	  have_star = false;
 	}
@@ -78,26 +76,22 @@ namespace Apex
     }
   }
 
-  Filename::Filename(const char* data, std::size_t length):
-    name(FILENAME_CHARS),
-    ext(EXTENSION_CHARS),
-    m_has_wildcard(false)
+  Filename::Filename(const char* data, std::size_t length)
   {
-    if (length != (FILENAME_CHARS + EXTENSION_CHARS))
+    if (length != LENGTH)
     {
-      throw FilenameError(std::format("raw Apex filespec must be exactly {} characters", FILENAME_CHARS + EXTENSION_CHARS));
+      throw FilenameError(std::format("raw Apex filespec must be exactly {} characters", LENGTH));
     }
-    std::memcpy(name.data(), data, FILENAME_CHARS);
-    std::memcpy(ext.data(),  data + FILENAME_CHARS, EXTENSION_CHARS);
+    std::memcpy(m_chars.data(), data, LENGTH);
   }
 
   bool Filename::has_wildcard() const
   {
-    return m_has_wildcard;
+    return std::any_of(m_chars.begin(), m_chars.end(), [](char c) { return (c == '?') || (c == '*'); });
   }
 
-  static bool part_match(const std::vector<char>& pat,
-			 const std::vector<char>& fn)
+  static bool part_match(std::string_view pat,
+			 std::string_view fn)
   {
     for (unsigned i = 0; i < pat.size(); i++)
     {
@@ -123,39 +117,481 @@ namespace Apex
 
   bool Filename::match(const Filename& other) const
   {
-    return part_match(name, other.name) && part_match(ext, other.ext);
+    return part_match(name(), other.name()) && part_match(ext(), other.ext());
   }
 
-  static std::string part_to_string(const std::vector<char>& part)
+  static std::string_view part_to_string(std::string_view part)
   {
     std::size_t length = part.size();
     while (length && (part[length - 1] == ' '))
     {
       --length;
     }
-    return std::string(part.begin(), part.begin() + length);
+    return part.substr(0, length);
   }
 
   std::string Filename::to_string() const
   {
-    std::string n = part_to_string(name);
-    std::string e = part_to_string(ext);
-    return e.size() ? n + '.' + e : n;
+    std::string s(part_to_string(name()));
+    std::string_view e = part_to_string(ext());
+    if (e.size())
+    {
+      s += '.';
+      s += e;
+    }
+    return s;
   }
 
   Filename Filename::upcase() const
   {
-    Filename fn;
-    for (std::size_t i = 0; i < FILENAME_CHARS; i++)
+    Filename fn = *this;
+    for (char& c: fn.m_chars)
     {
-      fn.name[i] = utility::upcase_character(name[i]);
+      c = utility::upcase_character(c);
     }
-    for (std::size_t i = 0; i < EXTENSION_CHARS; i++)
+    return fn;
+  }
+
+  const char* Filename::data() const
+  {
+    return m_chars.data();
+  }
+
+  std::string_view Filename::name() const
+  {
+    return std::string_view(m_chars.data(), FILENAME_CHARS);
+  }
+
+  std::string_view Filename::ext() const
+  {
+    return std::string_view(m_chars.data() + FILENAME_CHARS, EXTENSION_CHARS);
+  }
+
+  std::uint64_t Filename::name_word() const
+  {
+    std::uint64_t word;
+    std::memcpy(& word, m_chars.data(), sizeof(word));
+    return word;
+  }
+
+  std::uint32_t Filename::ext_word() const
+  {
+    std::uint32_t word = 0;
+    std::memcpy(& word, m_chars.data() + FILENAME_CHARS, EXTENSION_CHARS);
+    return word;
+  }
+
+  bool Filename::operator==(const Filename& other) const
+  {
+    return (name_word() == other.name_word()) && (ext_word() == other.ext_word());
+  }
+
+  bool Filename::operator<(const Filename& other) const
+  {
+    return std::memcmp(m_chars.data(), other.m_chars.data(), LENGTH) < 0;
+  }
+
+  std::size_t Filename::hash() const
+  {
+    std::uint64_t h = name_word() ^ (static_cast<std::uint64_t>(ext_word()) * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 32;
+    h *= 0xd6e8feb86659fd93ULL;
+    h ^= h >> 32;
+    return static_cast<std::size_t>(h);
+  }
+
+
+  using ByteVector = std::uint8_t __attribute__((vector_size(Pattern::VECTOR_SIZE)));
+
+  static ByteVector load_byte_vector(const void* data)
+  {
+    ByteVector v;
+    std::memcpy(& v, data, sizeof(v));
+    return v;
+  }
+
+  static ByteVector upcase_byte_vector(ByteVector v)
+  {
+    ByteVector lower = (v >= 'a') & (v <= 'z');
+    return v - (lower & 0x20);
+  }
+
+  static void store_byte_vector(void* data, ByteVector v)
+  {
+    std::memcpy(data, & v, sizeof(v));
+  }
+
+  static bool all_lanes_set(ByteVector v)
+  {
+    std::uint64_t words[sizeof(v) / sizeof(std::uint64_t)];
+    std::memcpy(words, & v, sizeof(v));
+    return (words[0] & words[1]) == ~std::uint64_t(0);
+  }
+
+  static bool any_lane_set(ByteVector v)
+  {
+    std::uint64_t words[sizeof(v) / sizeof(std::uint64_t)];
+    std::memcpy(words, & v, sizeof(v));
+    return (words[0] | words[1]) != 0;
+  }
+
+  static std::size_t first_set_lane(ByteVector v)
+  {
+    std::size_t lane = 0;
+    while (! v[lane])
     {
-      fn.ext[i] = utility::upcase_character(ext[i]);
+      ++lane;
     }
+    return lane;
+  }
 
-    return fn;
+  Pattern::Pattern(const Filename& pattern)
+  {
+    m_mask.fill(0x00);
+    m_value.fill(0x00);
+    const std::array<std::pair<std::size_t, std::size_t>, 2> parts
+    {{
+      { 0,              FILENAME_CHARS },
+      { FILENAME_CHARS, EXTENSION_CHARS },
+    }};
+    for (const auto& [offset, size]: parts)
+    {
+      for (std::size_t i = offset; i < offset + size; i++)
+      {
+	char c = pattern.data()[i];
+	if (c == '*')
+	{
+	  break;  // wildcard match entire remainder
+	}
+	if (c == '?')
+	{
+	  continue;  // wildcard match one character position
+	}
+	m_mask[i] = 0xff;
+	m_value[i] = utility::upcase_character(c);
+	if (c == ' ')
+	{
+	  break;  // matched up to trailing space fill
+	}
+      }
+    }
+  }
+
+  bool Pattern::match(const Filename& filename) const
+  {
+    alignas(VECTOR_SIZE) std::array<std::uint8_t, VECTOR_SIZE> chars {};
+    std::memcpy(chars.data(), filename.data(), Filename::LENGTH);
+    ByteVector fn = upcase_byte_vector(load_byte_vector(chars.data()));
+    ByteVector eq = (fn & load_byte_vector(m_mask.data())) == load_byte_vector(m_value.data());
+    return all_lanes_set(eq);
+  }
+
+
+  bool text_to_host(std::span<const std::uint8_t> apex_text,
+		    std::vector<std::uint8_t>& host_text)
+  {
+    std::size_t base = host_text.size();
+    host_text.resize(base + apex_text.size());
+    std::uint8_t* out = host_text.data() + base;
+
+    // strip high bits, translate CR to LF, and stop at the control-Z,
+    // a vector at a time
+    std::size_t i = 0;
+    for (; (i + sizeof(ByteVector)) <= apex_text.size(); i += sizeof(ByteVector))
+    {
+      ByteVector v = load_byte_vector(apex_text.data() + i) & 0x7f;
+      ByteVector end = (ByteVector) (v == TEXT_END);
+      v ^= (ByteVector) (v == '\r') & ('\r' ^ '\n');
+      store_byte_vector(out + i, v);
+      if (any_lane_set(end))
+      {
+	host_text.resize(base + i + first_set_lane(end));
+	return true;
+      }
+    }
+    for (; i < apex_text.size(); i++)
+    {
+      std::uint8_t c = apex_text[i] & 0x7f;
+      if (c == TEXT_END)
+      {
+	host_text.resize(base + i);
+	return true;
+      }
+      out[i] = (c == '\r') ? '\n' : c;
+    }
+    return false;
+  }
+
+  void text_from_host(std::span<const std::uint8_t> host_text,
+		      bool high_bit,
+		      std::vector<std::uint8_t>& apex_text)
+  {
+    std::size_t base = apex_text.size();
+    apex_text.resize(base + host_text.size() + BYTES_PER_BLOCK);
+    std::uint8_t* out = apex_text.data() + base;
+    std::uint8_t high = high_bit ? 0x80 : 0x00;
+
+    // Translate LF to CR and set high bits a vector at a time. The
+    // rare vectors containing a CR, which may be the first half of a
+    // CR LF pair, are done a byte at a time.
+    std::size_t n = 0;
+    std::size_t i = 0;
+    while (i < host_text.size())
+    {
+      if ((i + sizeof(ByteVector)) <= host_text.size())
+      {
+	ByteVector v = load_byte_vector(host_text.data() + i);
+	if (! any_lane_set((ByteVector) (v == '\r')))
+	{
+	  v ^= (ByteVector) (v == '\n') & ('\n' ^ '\r');
+	  store_byte_vector(out + n, v | high);
+	  i += sizeof(ByteVector);
+	  n += sizeof(ByteVector);
+	  continue;
+	}
+      }
+      std::size_t chunk_end = std::min(i + sizeof(ByteVector), host_text.size());
+      for (; i < chunk_end; i++)
+      {
+	std::uint8_t c = host_text[i];
+	if ((c == '\r') && ((i + 1) < host_text.size()) && (host_text[i + 1] == '\n'))
+	{
+	  continue;
+	}
+	out[n++] = ((c == '\n') ? '\r' : c) | high;
+      }
+    }
+
+    // terminator, and padding to a whole block
+    do
+    {
+      out[n++] = TEXT_END;
+    }
+    while (n % BYTES_PER_BLOCK);
+    apex_text.resize(base + n);
+  }
+
+  bool blocks_equal(const std::uint8_t* a, const std::uint8_t* b)
+  {
+    // differences are accumulated over the whole block, then tested
+    // once
+    ByteVector diff {};
+    for (std::size_t i = 0; i < BYTES_PER_BLOCK; i += sizeof(ByteVector))
+    {
+      diff |= load_byte_vector(a + i) ^ load_byte_vector(b + i);
+    }
+    return ! any_lane_set(diff);
+  }
+
+  static std::uint64_t load_u64_le(const std::uint8_t* data)
+  {
+    std::uint64_t word = 0;
+    for (std::size_t i = 0; i < sizeof(word); i++)
+    {
+      word |= static_cast<std::uint64_t>(data[i]) << (8 * i);
+    }
+    return word;
+  }
+
+  std::uint64_t block_hash(const std::uint8_t* block)
+  {
+    // four independent lanes, so that the multiplies can overlap,
+    // mixed together at the end
+    constexpr std::uint64_t multiplier = 0xd6e8feb86659fd93ULL;
+    std::array<std::uint64_t, 4> lane
+    {
+      0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL, 0x94d049bb133111ebULL, 0x2545f4914f6cdd1dULL
+    };
+    for (std::size_t i = 0; i < BYTES_PER_BLOCK; i += lane.size() * sizeof(std::uint64_t))
+    {
+      for (std::size_t j = 0; j < lane.size(); j++)
+      {
+	lane[j] = (lane[j] ^ load_u64_le(block + i + j * sizeof(std::uint64_t))) * multiplier;
+	lane[j] ^= lane[j] >> 29;
+      }
+    }
+    std::uint64_t h = lane[0];
+    for (std::size_t j = 1; j < lane.size(); j++)
+    {
+      h = (h ^ lane[j]) * multiplier;
+      h ^= h >> 32;
+    }
+    return h;
+  }
+
+
+  FreeExtentMap::FreeExtentMap():
+    m_count(0),
+    m_free_block_count(0)
+  {
+  }
+
+  void FreeExtentMap::clear()
+  {
+    m_count = 0;
+    m_free_block_count = 0;
+  }
+
+  void FreeExtentMap::release(std::uint16_t begin, std::uint16_t end)
+  {
+    if (begin >= end)
+    {
+      return;
+    }
+    // merge with all extents that overlap or abut the range
+    auto first = std::partition_point(m_by_address.begin(), m_by_address.begin() + m_count,
+				      [begin](const BlockRange& extent) { return extent.end < begin; });
+    auto last = first;
+    BlockRange merged { begin, end };
+    while ((last != m_by_address.begin() + m_count) && (last->begin <= end))
+    {
+      merged.begin = std::min(merged.begin, last->begin);
+      merged.end = std::max(merged.end, last->end);
+      ++last;
+    }
+    replace_extents(first - m_by_address.begin(), last - m_by_address.begin(), & merged, 1);
+  }
+
+  void FreeExtentMap::claim(std::uint16_t begin, std::uint16_t end)
+  {
+    if (begin >= end)
+    {
+      return;
+    }
+    // trim or split all extents that overlap the range
+    auto first = std::partition_point(m_by_address.begin(), m_by_address.begin() + m_count,
+				      [begin](const BlockRange& extent) { return extent.end <= begin; });
+    auto last = first;
+    std::array<BlockRange, 2> remaining;
+    std::size_t remaining_count = 0;
+    while ((last != m_by_address.begin() + m_count) && (last->begin < end))
+    {
+      if (last->begin < begin)
+      {
+	remaining[remaining_count++] = BlockRange { last->begin, begin };
+      }
+      if (last->end > end)
+      {
+	remaining[remaining_count++] = BlockRange { end, last->end };
+      }
+      ++last;
+    }
+    replace_extents(first - m_by_address.begin(), last - m_by_address.begin(), remaining.data(), remaining_count);
+  }
+
+  // size index order: ascending size, then address
+  static bool by_size_less(const BlockRange& a, const BlockRange& b)
+  {
+    return ((a.end - a.begin) < (b.end - b.begin)) ||
+	   (((a.end - a.begin) == (b.end - b.begin)) && (a.begin < b.begin));
+  }
+
+  void FreeExtentMap::replace_extents(std::size_t first,
+				      std::size_t last,
+				      const BlockRange* extents,
+				      std::size_t count)
+  {
+    std::size_t new_count = m_count - (last - first) + count;
+    if (new_count > MAX_EXTENTS)
+    {
+      throw std::runtime_error("too many free extents");
+    }
+
+    // The size index is updated by binary search removal and
+    // insertion of just the extents that change, so it is never
+    // sorted again.
+    std::size_t size_count = m_count;
+    for (std::size_t i = first; i < last; i++)
+    {
+      const BlockRange& extent = m_by_address[i];
+      auto it = std::lower_bound(m_by_size.begin(), m_by_size.begin() + size_count, extent, by_size_less);
+      std::copy(it + 1, m_by_size.begin() + size_count, it);
+      --size_count;
+      m_free_block_count -= extent.end - extent.begin;
+    }
+    for (std::size_t i = 0; i < count; i++)
+    {
+      const BlockRange& extent = extents[i];
+      auto it = std::lower_bound(m_by_size.begin(), m_by_size.begin() + size_count, extent, by_size_less);
+      std::copy_backward(it, m_by_size.begin() + size_count, m_by_size.begin() + size_count + 1);
+      *it = extent;
+      ++size_count;
+      m_free_block_count += extent.end - extent.begin;
+    }
+
+    std::copy(m_by_address.begin() + last,
+	      m_by_address.begin() + m_count,
+	      m_by_address.begin() + first + count);
+    std::copy(extents, extents + count, m_by_address.begin() + first);
+    m_count = new_count;
+
+    // the running maximum only changes from the first replaced extent on
+    std::uint16_t max_size = first ? m_max_size_through[first - 1] : 0;
+    for (std::size_t i = first; i < m_count; i++)
+    {
+      max_size = std::max<std::uint16_t>(max_size, m_by_address[i].end - m_by_address[i].begin);
+      m_max_size_through[i] = max_size;
+    }
+  }
+
+  std::uint16_t FreeExtentMap::find(std::uint16_t block_count,
+				    AllocationPolicy policy) const
+  {
+    if ((m_count == 0) || (m_max_size_through[m_count - 1] < block_count))
+    {
+      return 0;
+    }
+    switch (policy)
+    {
+    case AllocationPolicy::FIRST_FIT:
+      {
+	auto it = std::lower_bound(m_max_size_through.begin(), m_max_size_through.begin() + m_count, block_count);
+	return m_by_address[it - m_max_size_through.begin()].begin;
+      }
+    case AllocationPolicy::BEST_FIT:
+      block_count = std::max<std::uint16_t>(block_count, 1);
+      break;
+    case AllocationPolicy::WORST_FIT:
+      block_count = largest_extent_blocks();
+      break;
+    }
+    auto it = std::partition_point(m_by_size.begin(), m_by_size.begin() + m_count,
+				   [block_count](const BlockRange& extent) { return (extent.end - extent.begin) < block_count; });
+    return it->begin;
+  }
+
+  std::size_t FreeExtentMap::free_block_count() const
+  {
+    return m_free_block_count;
+  }
+
+  std::size_t FreeExtentMap::extent_count() const
+  {
+    return m_count;
+  }
+
+  std::uint16_t FreeExtentMap::largest_extent_blocks() const
+  {
+    return m_count ? m_max_size_through[m_count - 1] : 0;
+  }
+
+  double FreeExtentMap::fragmentation() const
+  {
+    if (m_free_block_count == 0)
+    {
+      return 0.0;
+    }
+    return 1.0 - static_cast<double>(largest_extent_blocks()) / m_free_block_count;
+  }
+
+  const BlockRange* FreeExtentMap::begin() const
+  {
+    return m_by_address.data();
+  }
+
+  const BlockRange* FreeExtentMap::end() const
+  {
+    return m_by_address.data() + m_count;
   }
 
 
@@ -168,7 +604,13 @@ namespace Apex
   {
     const auto now = std::chrono::system_clock::now();
     time_t tt = std::chrono::system_clock::to_time_t(now);
-    struct tm local_tm = *localtime(&tt);
+    struct tm local_tm;
+    // reentrant, as images may be processed on several threads
+#ifdef _WIN32
+    localtime_s(&local_tm, &tt);
+#else
+    localtime_r(&tt, &local_tm);
+#endif
     m_raw = (((local_tm.tm_year + 1900 - EPOCH_YEAR) << 9) +
 	     ((local_tm.tm_mon + 1) << 5) +
 	     local_tm.tm_mday);
@@ -232,16 +674,20 @@ namespace Apex
 
   DirectoryEntry::DirectoryEntry(Directory& dir,
 				 std::size_t index):
-    m_dir(dir),
+    m_dir(& dir),
     m_index(index)
   {
   }
 
   void DirectoryEntry::delete_file()
   {
-    m_dir.m_directory_data[DirectoryOffset::STATUS + m_index] = static_cast<std::uint8_t>(Status::INVALID);
-    m_dir.update_free_bitmap();
-    m_dir.update_disk_image();
+    if (get_status() == Status::VALID)
+    {
+      m_dir->release_blocks(get_first_block(), get_last_block());
+      m_dir->unindex_name(m_index);
+    }
+    m_dir->set_entry_status(m_index, Status::INVALID);
+    m_dir->update_disk_image();
   }
 
   void DirectoryEntry::replace(Status status,
@@ -250,55 +696,61 @@ namespace Apex
 			       std::uint16_t last_block,
 			       Date date)
   {
-    if (m_dir.m_directory_data[DirectoryOffset::STATUS + m_index] != static_cast<std::uint8_t>(Status::INVALID))
+    if (m_dir->m_directory_data[DirectoryOffset::STATUS + m_index] != static_cast<std::uint8_t>(Status::INVALID))
     {
       throw std::runtime_error("can't overwrite a directory entry that is in use");
     }
     
-    m_dir.m_directory_data[DirectoryOffset::STATUS + m_index] = static_cast<Status>(status);
+    m_dir->set_entry_status(m_index, status);
 
     Filename fn = filename.upcase();
 
-    std::size_t filename_offset = DirectoryOffset::FILENAME + m_index * (FILENAME_CHARS + EXTENSION_CHARS);
-    std::memcpy(m_dir.m_directory_data.data() + filename_offset,
-		fn.name.data(),
-		FILENAME_CHARS);
-    std::memcpy(m_dir.m_directory_data.data() + filename_offset + FILENAME_CHARS,
-		fn.ext.data(),
-		EXTENSION_CHARS);
+    std::size_t filename_offset = DirectoryOffset::FILENAME + m_index * Filename::LENGTH;
+    std::memcpy(m_dir->m_directory_data.data() + filename_offset,
+		fn.data(),
+		Filename::LENGTH);
 
-    m_dir.write_u16(DirectoryOffset::FIRST_BLOCK + m_index * 2, first_block);
-    m_dir.write_u16(DirectoryOffset::LAST_BLOCK + m_index * 2, last_block);
-    m_dir.write_u16(DirectoryOffset::FDATE + m_index * 2, date.get_raw());
+    m_dir->write_u16(DirectoryOffset::FIRST_BLOCK + m_index * 2, first_block);
+    m_dir->write_u16(DirectoryOffset::LAST_BLOCK + m_index * 2, last_block);
+    m_dir->write_u16(DirectoryOffset::FDATE + m_index * 2, date.get_raw());
 
-    m_dir.set_unsorted();
+    m_dir->set_unsorted();
 
-    m_dir.update_free_bitmap();
-    m_dir.update_disk_image();
+    if (status == Status::VALID)
+    {
+      m_dir->claim_blocks(first_block, last_block);
+      m_dir->index_name(m_index);
+    }
+    m_dir->update_disk_image();
+  }
+
+  std::size_t DirectoryEntry::get_index() const
+  {
+    return m_index;
   }
 
   DirectoryEntry::Status DirectoryEntry::get_status() const
   {
-    return static_cast<Status>(m_dir.m_directory_data[DirectoryOffset::STATUS + m_index]);
+    return static_cast<Status>(m_dir->m_directory_data[DirectoryOffset::STATUS + m_index]);
   }
 
   Filename DirectoryEntry::get_filename() const
   {
     std::size_t filename_offset = DirectoryOffset::FILENAME + m_index * (FILENAME_CHARS + EXTENSION_CHARS);
-    Filename f(reinterpret_cast<const char*>(m_dir.m_directory_data.data() + filename_offset), FILENAME_CHARS + EXTENSION_CHARS);
+    Filename f(reinterpret_cast<const char*>(m_dir->m_directory_data.data() + filename_offset), FILENAME_CHARS + EXTENSION_CHARS);
     return f;
   }
 
   std::uint16_t DirectoryEntry::get_first_block() const
   {
     std::size_t offset = DirectoryOffset::FIRST_BLOCK + m_index * 2;
-    return m_dir.read_u16(offset);
+    return m_dir->read_u16(offset);
   }
 
   std::uint16_t DirectoryEntry::get_last_block() const
   {
     std::size_t offset = DirectoryOffset::LAST_BLOCK + m_index * 2;
-    return m_dir.read_u16(offset);
+    return m_dir->read_u16(offset);
   }
 
   std::uint16_t DirectoryEntry::get_block_count() const
@@ -309,11 +761,12 @@ namespace Apex
   Date DirectoryEntry::get_date() const
   {
     std::size_t offset = DirectoryOffset::FDATE + m_index * 2;
-    return Date(m_dir.read_u16(offset));
+    return Date(m_dir->read_u16(offset));
   }
 
-  Directory::iterator::iterator(Directory& dir, std::size_t index):
+  Directory::iterator::iterator(Directory& dir, std::uint64_t mask, std::size_t index):
     m_dir(dir),
+    m_mask(mask),
     m_index(index)
   {
   }
@@ -335,13 +788,14 @@ namespace Apex
     }
     set_unsorted();
     set_locked(false);
-    update_free_bitmap();
+    rebuild_indexes();
     update_disk_image();
   }
 
   Directory::iterator& Directory::iterator::operator++()  // pre-increment
   {
-    ++m_index;
+    std::uint64_t remaining = m_mask & ~((std::uint64_t(2) << m_index) - 1);
+    m_index = remaining ? std::countr_zero(remaining) : ENTRIES_PER_DIRECTORY;
     return *this;
   }
 
@@ -354,7 +808,8 @@ namespace Apex
 
   Directory::iterator& Directory::iterator::operator--()  // pre-decrement
   {
-    --m_index;
+    std::uint64_t preceding = m_mask & ((std::uint64_t(1) << m_index) - 1);
+    m_index = 63 - std::countl_zero(preceding);
     return *this;
   }
 
@@ -382,25 +837,46 @@ namespace Apex
     {
       throw std::runtime_error(std::format("dereferencing iterator with index {}", m_index));
     }
-    return *m_dir.m_directory_entries[m_index];
+    return m_dir.m_directory_entries[m_index];
+  }
+
+  Directory::iterator::pointer Directory::iterator::operator->()
+  {
+    return & operator*();
+  }
+
+  Directory::EntryRange::EntryRange(Directory& dir, std::uint64_t mask):
+    m_dir(dir),
+    m_mask(mask & ALL_ENTRIES_MASK)
+  {
+  }
+
+  Directory::iterator Directory::EntryRange::begin()
+  {
+    return iterator(m_dir, m_mask, m_mask ? std::countr_zero(m_mask) : ENTRIES_PER_DIRECTORY);
+  }
+
+  Directory::iterator Directory::EntryRange::end()
+  {
+    return iterator(m_dir, m_mask, ENTRIES_PER_DIRECTORY);
+  }
+
+  template <std::size_t... index>
+  std::array<DirectoryEntry, sizeof...(index)> Directory::make_directory_entries(std::index_sequence<index...>)
+  {
+    return { DirectoryEntry(*this, index)... };
   }
 
   Directory::Directory(Disk& disk, std::uint16_t start_block):
     m_disk(disk),
-    m_start_block(start_block)
+    m_start_block(start_block),
+    m_directory_entries(make_directory_entries(std::make_index_sequence<ENTRIES_PER_DIRECTORY>())),
+    m_in_transaction(false)
   {
     m_disk.read(m_start_block,
 		BLOCKS_PER_DIRECTORY,
 		m_directory_data.data());
-    update_free_bitmap();
-  }
-
-  Directory::~Directory()
-  {
-    for (unsigned i = 0; i < ENTRIES_PER_DIRECTORY; i++)
-    {
-      delete m_directory_entries[i];
-    }
+    rebuild_indexes();
   }
 
   std::uint16_t Directory::get_volume_number() const
@@ -484,59 +960,241 @@ namespace Apex
     m_directory_data[offset + 1] = value >> 8;
   }
 
-  DirectoryEntry& Directory::allocate_directory_entry()
+  DirectoryEntry& Directory::get_entry(std::size_t index)
+  {
+    return m_directory_entries.at(index);
+  }
+
+  DirectoryEntry* Directory::find(const Filename& filename)
   {
-    for (DirectoryEntry* entry: m_directory_entries)
+    Filename key = filename.upcase();
+    for (std::size_t slot = name_index_home(key);
+	 m_name_index[slot] != NAME_INDEX_EMPTY;
+	 slot = (slot + 1) % NAME_INDEX_SLOTS)
     {
-      if (entry->get_status() == DirectoryEntry::Status::INVALID)
+      DirectoryEntry& entry = m_directory_entries[m_name_index[slot]];
+      if ((entry.get_status() == DirectoryEntry::Status::VALID) &&
+	  (entry.get_filename().upcase() == key))
       {
-	return *entry;
+	return & entry;
       }
     }
+    return nullptr;
+  }
+
+  std::size_t Directory::name_index_home(const Filename& upcased_filename) const
+  {
+    return upcased_filename.hash() % NAME_INDEX_SLOTS;
+  }
+
+  void Directory::rebuild_name_index()
+  {
+    m_name_index.fill(NAME_INDEX_EMPTY);
+    for (const DirectoryEntry& entry: valid_entries())
+    {
+      index_name(entry.get_index());
+    }
+  }
+
+  void Directory::index_name(std::size_t entry_index)
+  {
+    std::size_t slot = name_index_home(m_directory_entries[entry_index].get_filename().upcase());
+    while (m_name_index[slot] != NAME_INDEX_EMPTY)
+    {
+      slot = (slot + 1) % NAME_INDEX_SLOTS;
+    }
+    m_name_index[slot] = entry_index;
+  }
+
+  void Directory::unindex_name(std::size_t entry_index)
+  {
+    std::size_t slot = name_index_home(m_directory_entries[entry_index].get_filename().upcase());
+    while (m_name_index[slot] != entry_index)
+    {
+      if (m_name_index[slot] == NAME_INDEX_EMPTY)
+      {
+	return;  // not indexed
+      }
+      slot = (slot + 1) % NAME_INDEX_SLOTS;
+    }
+    // Backward shift deletion: move later entries of the probe
+    // sequence into the hole, unless that would move them before
+    // their home slot.
+    std::size_t hole = slot;
+    for (std::size_t next = (hole + 1) % NAME_INDEX_SLOTS;
+	 m_name_index[next] != NAME_INDEX_EMPTY;
+	 next = (next + 1) % NAME_INDEX_SLOTS)
+    {
+      std::size_t home = name_index_home(m_directory_entries[m_name_index[next]].get_filename().upcase());
+      std::size_t hole_distance = (hole - home + NAME_INDEX_SLOTS) % NAME_INDEX_SLOTS;
+      std::size_t next_distance = (next - home + NAME_INDEX_SLOTS) % NAME_INDEX_SLOTS;
+      if (hole_distance < next_distance)
+      {
+	m_name_index[hole] = m_name_index[next];
+	hole = next;
+      }
+    }
+    m_name_index[hole] = NAME_INDEX_EMPTY;
+  }
+
+  std::uint64_t Directory::match(const std::vector<Pattern>& patterns) const
+  {
+    std::uint64_t result = 0;
+    for (std::uint64_t valid = get_status_mask(DirectoryEntry::Status::VALID); valid; valid &= valid - 1)
+    {
+      std::size_t i = std::countr_zero(valid);
+      // A vector load at an entry's filename also picks up bytes of
+      // the following entries, but those lanes have a zero mask.
+      ByteVector fn = upcase_byte_vector(load_byte_vector(m_directory_data.data() + DirectoryOffset::FILENAME + i * Filename::LENGTH));
+      for (const Pattern& pattern: patterns)
+      {
+	ByteVector eq = (fn & load_byte_vector(pattern.m_mask.data())) == load_byte_vector(pattern.m_value.data());
+	if (all_lanes_set(eq))
+	{
+	  result |= std::uint64_t(1) << i;
+	  break;
+	}
+      }
+    }
+    return result;
+  }
+
+  DirectoryEntry& Directory::allocate_directory_entry()
+  {
+    std::uint64_t invalid = get_status_mask(DirectoryEntry::Status::INVALID);
+    if (invalid)
+    {
+      return m_directory_entries[std::countr_zero(invalid)];
+    }
     throw std::runtime_error("out of directory entries");
   }
 
-  void Directory::update_free_bitmap()
+  void Directory::rebuild_free_bitmap()
+  {
+    m_free_extents.clear();
+    release_blocks(disk_area_block_range[DiskArea::FILE_AREA].begin, volume_size_blocks() - 1);
+    for (const DirectoryEntry& entry: valid_entries())
+    {
+      claim_blocks(entry.get_first_block(), entry.get_last_block());
+    }
+  }
+
+  // Free or claim an inclusive block range, limited to the file area.
+  // Free space is kept up to date incrementally by these rather than
+  // rebuilt on every directory change.
+  void Directory::release_blocks(std::uint16_t first_block,
+				 std::uint16_t last_block)
+  {
+    std::size_t begin = std::max<std::size_t>(first_block, disk_area_block_range[DiskArea::FILE_AREA].begin);
+    std::size_t end = std::min<std::size_t>(last_block + 1, volume_size_blocks());
+    if (begin < end)
+    {
+      m_free_extents.release(begin, end);
+    }
+  }
+
+  void Directory::claim_blocks(std::uint16_t first_block,
+			       std::uint16_t last_block)
   {
-    std::uint16_t max_block = volume_size_blocks();
-    m_free_bitmap.resize(max_block);
-    m_free_bitmap.reset();
-    for (std::size_t block = disk_area_block_range[DiskArea::FILE_AREA].begin;
-	 block < max_block;
-	 ++block)
+    std::size_t begin = std::max<std::size_t>(first_block, disk_area_block_range[DiskArea::FILE_AREA].begin);
+    std::size_t end = std::min<std::size_t>(last_block + 1, volume_size_blocks());
+    if (begin < end)
     {
-      m_free_bitmap[block] = true;
+      m_free_extents.claim(begin, end);
     }
-    bool consistency_error = false;
-    for (unsigned i = 0; i < ENTRIES_PER_DIRECTORY; i++)
+  }
+
+  bool Directory::check_consistency() const
+  {
+    std::size_t max_block = volume_size_blocks();
+    boost::dynamic_bitset<> used(max_block);
+    used.set(0, disk_area_block_range[DiskArea::FILE_AREA].begin, true);
+    for (const DirectoryEntry& entry: m_directory_entries)
     {
-      auto entry = new DirectoryEntry(*this, i);
-      m_directory_entries[i] = entry;
-      if (entry->get_status() == DirectoryEntry::Status::VALID)
+      if (entry.get_status() == DirectoryEntry::Status::VALID)
       {
-	std::uint16_t first = entry->get_first_block();
-	std::uint16_t last = entry->get_last_block();
+	std::size_t first = entry.get_first_block();
+	std::size_t last = entry.get_last_block();
+	if (last + 1 == first)
+	{
+	  continue;  // empty file, which occupies no blocks
+	}
+	if ((last < first) || (last >= max_block))
+	{
+	  return false;
+	}
 	for (std::size_t block = first; block <= last; block++)
 	{
-	  if (! m_free_bitmap[block])
+	  if (used[block])
 	  {
-	    consistency_error = true;
+	    return false;
 	  }
-	  m_free_bitmap[block] = false;
+	  used[block] = true;
 	}
       }
     }
-    if (consistency_error)
-    {
-      std::cerr << "directory inconsistent - file block ranges incorrect or overlap\n";
-    }
+    return true;
   }
 
   void Directory::update_disk_image()
   {
+    if (m_in_transaction)
+    {
+      return;  // deferred until commit
+    }
+    if (m_start_block != Disk::directory_start_block[Disk::DirectoryType::PRIMARY])
+    {
+      m_disk.write(m_start_block,
+		   BLOCKS_PER_DIRECTORY,
+		   m_directory_data.data());
+      return;
+    }
+    // The backup directory immediately follows the primary, so both
+    // are written in a single pass.
+    std::array<std::uint8_t, DIRECTORIES_PER_DISK * BLOCKS_PER_DIRECTORY * BYTES_PER_BLOCK> data;
+    for (std::size_t i = 0; i < DIRECTORIES_PER_DISK; i++)
+    {
+      std::memcpy(data.data() + i * m_directory_data.size(),
+		  m_directory_data.data(),
+		  m_directory_data.size());
+    }
     m_disk.write(m_start_block,
-		 BLOCKS_PER_DIRECTORY,
-		 m_directory_data.data());
+		 DIRECTORIES_PER_DISK * BLOCKS_PER_DIRECTORY,
+		 data.data());
+  }
+
+  Directory::Transaction::Transaction(Directory& dir):
+    m_dir(dir),
+    m_saved_directory_data(dir.m_directory_data),
+    m_active(true)
+  {
+    if (m_dir.m_in_transaction)
+    {
+      throw std::runtime_error("directory already has a transaction in progress");
+    }
+    m_dir.m_in_transaction = true;
+  }
+
+  Directory::Transaction::~Transaction()
+  {
+    if (m_active)
+    {
+      // not committed, roll back
+      m_dir.m_directory_data = m_saved_directory_data;
+      m_dir.rebuild_indexes();
+      m_dir.m_in_transaction = false;
+    }
+  }
+
+  void Directory::Transaction::commit()
+  {
+    if (! m_active)
+    {
+      throw std::runtime_error("directory transaction already committed");
+    }
+    m_active = false;
+    m_dir.m_in_transaction = false;
+    m_dir.update_disk_image();
   }
 
   std::size_t Directory::volume_size_blocks() const
@@ -546,62 +1204,105 @@ namespace Apex
 
   std::size_t Directory::volume_free_blocks() const
   {
-    return m_free_bitmap.count();
+    return m_free_extents.free_block_count();
   }
 
-  std::uint16_t Directory::find_free_blocks(std::uint16_t requested_block_count) const
+  std::uint16_t Directory::find_free_blocks(std::uint16_t requested_block_count,
+					    AllocationPolicy policy) const
   {
-    std::size_t max_block = volume_size_blocks();
-    boost::dynamic_bitset<> m_used_bitmap = ~m_free_bitmap;
-    std::size_t free_block_num = m_free_bitmap.find_first();
-    while (free_block_num < max_block)
-    {
-      std::size_t used_block_num = std::min(m_used_bitmap.find_next(free_block_num), max_block);
-      std::size_t free_block_count = used_block_num - free_block_num;
-      if (free_block_count >= requested_block_count)
-      {
-	return free_block_num;
-      }
-      free_block_num = m_free_bitmap.find_next(used_block_num);
-    }
-    return 0;  // failed to find requested number of free blocks
+    return m_free_extents.find(requested_block_count, policy);
   }
 
-  void Directory::debug_list_free_blocks() const
+  const FreeExtentMap& Directory::get_free_extents() const
   {
-    std::size_t max_block = volume_size_blocks();
-    boost::dynamic_bitset<> m_used_bitmap = ~m_free_bitmap;
-    std::cout << "Free blocks:\n";
-    std::size_t free_extent_count = 0;
-    std::size_t free_block_count = 0;
-    std::size_t free_block_num = m_free_bitmap.find_first();
-    while (free_block_num < max_block)
-    {
-      std::size_t used_block_num = std::min(m_used_bitmap.find_next(free_block_num), max_block);
-      std::cout << std::format("{} blocks free from {} through {}\n",
-			       used_block_num - free_block_num,
-			       free_block_num,
-			       used_block_num-1);
-      ++free_extent_count;
-      free_block_count += used_block_num - free_block_num;
-      free_block_num = m_free_bitmap.find_next(used_block_num);
-    }
-    std::cout << std::format("total {} free blocks found in {} extents\n",
-			     free_block_count,
-			     free_extent_count);
+    return m_free_extents;
+  }
+
+  void Directory::debug_list_free_blocks(std::ostream& out) const
+  {
+    out << "Free blocks:\n";
+    for (const BlockRange& extent: m_free_extents)
+    {
+      out << std::format("{} blocks free from {} through {}\n",
+		       extent.end - extent.begin,
+		       extent.begin,
+		       extent.end - 1);
+    }
+    out << std::format("total {} free blocks found in {} extents\n",
+		     m_free_extents.free_block_count(),
+		     m_free_extents.extent_count());
+    out << std::format("largest free extent {} blocks, fragmentation {:.1f}%\n",
+		     m_free_extents.largest_extent_blocks(),
+		     100.0 * m_free_extents.fragmentation());
   }
 
   Directory::iterator Directory::begin()
   {
-    // XXX need to use the first non-deleted directory entry,
-    //     of if there isn't one, npos
-    return iterator(*this, 0);
+    return entries(ALL_ENTRIES_MASK).begin();
   }
 
   Directory::iterator Directory::end()
   {
-    // XXX should use npos
-    return iterator(*this, ENTRIES_PER_DIRECTORY);
+    return entries(ALL_ENTRIES_MASK).end();
+  }
+
+  int Directory::status_mask_slot(DirectoryEntry::Status status)
+  {
+    switch (status)
+    {
+    case DirectoryEntry::Status::VALID:     return 0;
+    case DirectoryEntry::Status::INVALID:   return 1;
+    case DirectoryEntry::Status::REPLACE:   return 2;
+    case DirectoryEntry::Status::TENTATIVE: return 3;
+    default:                                return -1;
+    }
+  }
+
+  void Directory::set_entry_status(std::size_t index, DirectoryEntry::Status status)
+  {
+    std::uint64_t bit = std::uint64_t(1) << index;
+    for (std::uint64_t& mask: m_status_mask)
+    {
+      mask &= ~bit;
+    }
+    int slot = status_mask_slot(status);
+    if (slot >= 0)
+    {
+      m_status_mask[slot] |= bit;
+    }
+    m_directory_data[DirectoryOffset::STATUS + index] = status;
+  }
+
+  std::uint64_t Directory::get_status_mask(DirectoryEntry::Status status) const
+  {
+    int slot = status_mask_slot(status);
+    return (slot >= 0) ? m_status_mask[slot] : 0;
+  }
+
+  std::size_t Directory::valid_count() const
+  {
+    return std::popcount(get_status_mask(DirectoryEntry::Status::VALID));
+  }
+
+  Directory::EntryRange Directory::entries(std::uint64_t mask)
+  {
+    return EntryRange(*this, mask);
+  }
+
+  Directory::EntryRange Directory::valid_entries()
+  {
+    return entries(get_status_mask(DirectoryEntry::Status::VALID));
+  }
+
+  void Directory::rebuild_indexes()
+  {
+    m_status_mask.fill(0);
+    for (std::size_t i = 0; i < ENTRIES_PER_DIRECTORY; i++)
+    {
+      set_entry_status(i, static_cast<DirectoryEntry::Status>(m_directory_data[DirectoryOffset::STATUS + i]));
+    }
+    rebuild_free_bitmap();
+    rebuild_name_index();
   }
 
   Disk::Disk(AppleII::DiskImage::ImageFormat format):
@@ -642,24 +1343,16 @@ namespace Apex
 		  std::size_t block_count,
 		  std::uint8_t* data)
   {
-    std::uint8_t sectors = get_geometry(get_format()).sectors;
-    AppleII::DiskImage::read(block_number / sectors,  // track
-			     0,                       // head
-			     block_number % sectors,  // sector
-			     block_count,
-			     data);
+    // Apex blocks are the same size as sectors, so the block number
+    // is the logical sector number
+    AppleII::DiskImage::read_logical(block_number, block_count, data);
   }
 
   void Disk::write(std::uint16_t block_number,
 		   std::size_t block_count,
 		   const std::uint8_t* data)
   {
-    std::uint8_t sectors = get_geometry(get_format()).sectors;
-    AppleII::DiskImage::write(block_number / sectors,  // track
-			      0,                       // head
-			      block_number % sectors,  // sector
-			      block_count,
-			      data);
+    AppleII::DiskImage::write_logical(block_number, block_count, data);
   }
 
 } // end namespace Apex
@@ -7,9 +7,14 @@
 #define APEX_DISK_HH
 
 #include <array>
+#include <iosfwd>
 #include <iterator>
+#include <span>
 #include <string>
+#include <string_view>
 #include <time.h>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include <boost/dynamic_bitset.hpp>
@@ -29,6 +34,9 @@ namespace Apex
   static constexpr std::size_t ENTRIES_PER_DIRECTORY = 48;
   static constexpr std::size_t DIRECTORIES_PER_DISK = 2;
 
+  static constexpr std::uint64_t ALL_ENTRIES_MASK = (std::uint64_t(1) << ENTRIES_PER_DIRECTORY) - 1;
+  static_assert(ENTRIES_PER_DIRECTORY <= 64);
+
   static constexpr unsigned FILENAME_CHARS = 8;
   static constexpr unsigned EXTENSION_CHARS = 3;
 
@@ -37,16 +45,18 @@ namespace Apex
   struct FilenameError: std::runtime_error
   { FilenameError(const std::string& what); };
 
+  // Packed, fixed-size Apex filename: the raw 11 directory bytes, name
+  // and extension padded with spaces, no period separator. Trivially
+  // copyable, and compared and hashed as two machine words.
   class Filename
   {
   public:
-    std::vector<char> name;
-    std::vector<char> ext;
+    static constexpr std::size_t LENGTH = FILENAME_CHARS + EXTENSION_CHARS;
 
     // invalid filename
     Filename();
 
-    Filename(const std::string& pattern);
+    Filename(std::string_view pattern);
 
     // raw Apex filename, must be exactly 11 characters,
     // name and extension padded with spaces, no period
@@ -61,16 +71,133 @@ namespace Apex
 
     Filename upcase() const;
 
+    // raw representation, LENGTH characters
+    const char* data() const;
+    std::string_view name() const;
+    std::string_view ext() const;
+
+    bool operator==(const Filename& other) const;
+    bool operator<(const Filename& other) const;
+
+    std::size_t hash() const;
+
+  private:
+    std::uint64_t name_word() const;
+    std::uint32_t ext_word() const;
+
+    std::array<char, LENGTH> m_chars;
+  };
+
+  static_assert(std::is_trivially_copyable_v<Filename>);
+  static_assert(sizeof(Filename) == Filename::LENGTH);
+
+  // A Filename pattern compiled to a per-character mask and value, so
+  // that a filename matches if (upcase(filename) & mask) == value.
+  // Handles '?', '*', and the space fill that ends a name or
+  // extension the same way as Filename::match().
+  class Pattern
+  {
+  public:
+    static constexpr std::size_t VECTOR_SIZE = 16;
+
+    Pattern(const Filename& pattern);
+
+    bool match(const Filename& filename) const;
+
   private:
-    bool m_has_wildcard;
+    // padded to vector width with zero mask and value
+    alignas(VECTOR_SIZE) std::array<std::uint8_t, VECTOR_SIZE> m_mask;
+    alignas(VECTOR_SIZE) std::array<std::uint8_t, VECTOR_SIZE> m_value;
+
+    friend class Directory;
   };
 
+  // Apex text has CR line ends, may have the high bit set on each
+  // character, and ends with a control-Z, padded out to a whole
+  // number of blocks. Host text has LF line ends, no high bits, and
+  // no terminator.
+  static constexpr std::uint8_t TEXT_END = 0x1a;  // control-Z
+
+  // Append the host form of Apex text to host_text. Returns true if
+  // the control-Z was found, in which case it and anything following
+  // it have been dropped; otherwise the caller may continue with the
+  // next part of the file.
+  bool text_to_host(std::span<const std::uint8_t> apex_text,
+		    std::vector<std::uint8_t>& host_text);
+
+  // Append the Apex form of host text to apex_text, including the
+  // control-Z and padding, optionally setting the high bit of each
+  // character. CR LF line ends become a single CR.
+  void text_from_host(std::span<const std::uint8_t> host_text,
+		      bool high_bit,
+		      std::vector<std::uint8_t>& apex_text);
+
+  // Block comparison, for diff and patch. Each block is BYTES_PER_BLOCK
+  // bytes. The hash is the same on any host.
+  bool blocks_equal(const std::uint8_t* a, const std::uint8_t* b);
+  std::uint64_t block_hash(const std::uint8_t* block);
+
   struct BlockRange
   {
     std::uint16_t begin;
     std::uint16_t end;  // plus one
   };
 
+  enum class AllocationPolicy
+  {
+    FIRST_FIT,  // lowest addressed free extent that is large enough
+    BEST_FIT,   // smallest free extent that is large enough
+    WORST_FIT,  // largest free extent
+  };
+
+  // Free space as a sorted set of extents, plus an index by size.
+  // Storage is fixed, as an Apex volume can't have more free extents
+  // than files plus one (allowing another for the reserved area).
+  // Updates are O(n) in the number of extents, with no sorting;
+  // allocation lookups for all policies are O(log n).
+  class FreeExtentMap
+  {
+  public:
+    static constexpr std::size_t MAX_EXTENTS = 50;
+
+    FreeExtentMap();
+
+    void clear();
+
+    // ranges are half-open, [begin, end)
+    void release(std::uint16_t begin, std::uint16_t end);
+    void claim(std::uint16_t begin, std::uint16_t end);
+
+    // returns first block of a free extent of at least block_count
+    // blocks, or 0 if there is none
+    std::uint16_t find(std::uint16_t block_count,
+		       AllocationPolicy policy) const;
+
+    std::size_t free_block_count() const;
+    std::size_t extent_count() const;
+    std::uint16_t largest_extent_blocks() const;
+
+    // fraction of free space not in the largest extent, 0.0 to 1.0
+    double fragmentation() const;
+
+    // extents in address order
+    const BlockRange* begin() const;
+    const BlockRange* end() const;
+
+  private:
+    void replace_extents(std::size_t first,
+			 std::size_t last,
+			 const BlockRange* extents,
+			 std::size_t count);
+
+    std::size_t m_count;
+    std::size_t m_free_block_count;
+    std::array<BlockRange, MAX_EXTENTS> m_by_address;
+    std::array<BlockRange, MAX_EXTENTS> m_by_size;  // ascending size, then address
+    // running maximum of extent size in address order, for first fit
+    std::array<std::uint16_t, MAX_EXTENTS> m_max_size_through;
+  };
+
   enum class DiskArea
   {
     BOOT,
@@ -173,6 +300,7 @@ namespace Apex
 		 std::uint16_t last_block,
 		 Date date);
 
+    std::size_t get_index() const;
     Status get_status() const;
     Filename get_filename() const;
     std::uint16_t get_first_block() const;
@@ -181,9 +309,11 @@ namespace Apex
     Date get_date() const;
 
   private:
+    // A DirectoryEntry is only a lightweight handle on an entry in
+    // its Directory's data; it owns no storage of its own.
     DirectoryEntry(Directory& dir,
 		   std::size_t index);
-    Directory& m_dir;
+    Directory* m_dir;
     std::size_t m_index;
 
     friend class Directory;
@@ -213,14 +343,53 @@ namespace Apex
       bool operator!=(const iterator& other);
 
     private:
-      iterator(Directory& dir, std::size_t index);
+      // visits only the entries whose bits are set in mask
+      iterator(Directory& dir, std::uint64_t mask, std::size_t index);
       Directory& m_dir;
+      std::uint64_t m_mask;
       std::size_t m_index;
 
       friend class Directory;
     };
 
-    ~Directory();
+    // the entries selected by a mask of entry indices
+    class EntryRange
+    {
+    public:
+      iterator begin();
+      iterator end();
+
+    private:
+      EntryRange(Directory& dir, std::uint64_t mask);
+      Directory& m_dir;
+      std::uint64_t m_mask;
+
+      friend class Directory;
+    };
+
+    // Stages directory changes in memory. Nothing is written to the
+    // disk image until commit(), which writes the primary and backup
+    // directories together. If the transaction is destroyed without
+    // being committed, the directory reverts to its prior contents.
+    class Transaction
+    {
+    public:
+      Transaction(Directory& dir);
+      ~Transaction();
+
+      Transaction(const Transaction&) = delete;
+      Transaction& operator=(const Transaction&) = delete;
+
+      void commit();
+
+    private:
+      Directory& m_dir;
+      std::array<std::uint8_t, BLOCKS_PER_DIRECTORY * BYTES_PER_BLOCK> m_saved_directory_data;
+      bool m_active;
+    };
+
+    Directory(const Directory&) = delete;
+    Directory& operator=(const Directory&) = delete;
 
     std::uint16_t get_volume_number() const;
 
@@ -237,30 +406,79 @@ namespace Apex
     std::size_t volume_free_blocks() const;
 
     // returns 0 if not found
-    std::uint16_t find_free_blocks(std::uint16_t requested_block_count) const;
+    std::uint16_t find_free_blocks(std::uint16_t requested_block_count,
+				   AllocationPolicy policy = AllocationPolicy::FIRST_FIT) const;
 
-    void debug_list_free_blocks() const;
+    const FreeExtentMap& get_free_extents() const;
 
+    void debug_list_free_blocks(std::ostream& out) const;
+
+    // Full pass over all valid entries, checking that their block
+    // ranges lie within the file area and don't overlap. Not done
+    // implicitly; free space is maintained incrementally.
+    bool check_consistency() const;
+
+    // all entries, regardless of status
     iterator begin();
     iterator end();
 
+    // Entries are also tracked by status in 64-bit occupancy masks,
+    // bit n for entry n. DISK_ERASED and unrecognized status values
+    // are not tracked.
+    std::uint64_t get_status_mask(DirectoryEntry::Status status) const;
+    std::size_t valid_count() const;
+
+    EntryRange entries(std::uint64_t mask);
+    EntryRange valid_entries();
+
+    DirectoryEntry& get_entry(std::size_t index);
+
+    // Look up a valid entry by name, ignoring case, through a hash
+    // index kept up to date as entries are replaced and deleted.
+    // Returns nullptr if there is no such file.
+    DirectoryEntry* find(const Filename& filename);
+
+    // Evaluates all patterns against the filenames of all entries at
+    // once. Returns a mask with bit n set if entry n is valid and
+    // matches at least one of the patterns.
+    std::uint64_t match(const std::vector<Pattern>& patterns) const;
+
     DirectoryEntry& allocate_directory_entry();
 
   private:
     Directory(Disk& disk, std::uint16_t start_block);
+    template <std::size_t... index>
+    std::array<DirectoryEntry, sizeof...(index)> make_directory_entries(std::index_sequence<index...>);
     void initialize(std::uint16_t block_count,
 		    std::uint16_t volume_number);
     std::uint16_t read_u16(std::size_t offset) const;
     void write_u16(std::size_t offset, std::uint16_t value);
-    void update_free_bitmap();
+    void rebuild_indexes();
+    void rebuild_free_bitmap();
+    static int status_mask_slot(DirectoryEntry::Status status);
+    void set_entry_status(std::size_t index, DirectoryEntry::Status status);
+    void release_blocks(std::uint16_t first_block, std::uint16_t last_block);
+    void claim_blocks(std::uint16_t first_block, std::uint16_t last_block);
     void update_disk_image();
+    std::size_t name_index_home(const Filename& upcased_filename) const;
+    void rebuild_name_index();
+    void index_name(std::size_t entry_index);
+    void unindex_name(std::size_t entry_index);
+
+    // open addressing, linear probing
+    static constexpr std::size_t NAME_INDEX_SLOTS = 64;
+    static constexpr std::uint8_t NAME_INDEX_EMPTY = 0xff;
+    static_assert(NAME_INDEX_SLOTS > ENTRIES_PER_DIRECTORY);
 
     Disk& m_disk;
     std::uint16_t m_start_block;
 
     std::array<std::uint8_t, BLOCKS_PER_DIRECTORY * BYTES_PER_BLOCK> m_directory_data;
-    std::array<DirectoryEntry*, ENTRIES_PER_DIRECTORY> m_directory_entries;
-    boost::dynamic_bitset<> m_free_bitmap;
+    std::array<DirectoryEntry, ENTRIES_PER_DIRECTORY> m_directory_entries;
+    FreeExtentMap m_free_extents;
+    std::array<std::uint8_t, NAME_INDEX_SLOTS> m_name_index;
+    std::array<std::uint64_t, 4> m_status_mask;  // VALID, INVALID, REPLACE, TENTATIVE
+    bool m_in_transaction;
 
     friend class DirectoryEntry;
     friend class Disk;
@@ -302,4 +520,13 @@ namespace Apex
   };
 } // end namespace Apex
 
+template <>
+struct std::hash<Apex::Filename>
+{
+  std::size_t operator()(const Apex::Filename& filename) const
+  {
+    return filename.hash();
+  }
+};
+
 #endif // APEX_DISK_HH
@@ -3,14 +3,27 @@
 // Copyright 2025 Eric Smith
 // SPDX-License-Identifier: GPL-3.0-only
 
+#include <algorithm>
+#include <array>
 #include <cstring>
 #include <format>
 #include <fstream>
 #include <iostream>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include <zlib.h>
+
 #include <magic_enum_utility.hpp>
 
 #include "apple_ii_disk.hh"
+#include "utility.hh"
 
 namespace AppleII
 {
@@ -27,16 +40,179 @@ namespace AppleII
   static constexpr uint8_t apex_order_phys_to_log_table[] =
   { 0x0, 0xe, 0xd, 0xc, 0xb, 0xa, 0x9, 0x8, 0x7, 0x6, 0x5, 0x4, 0x3, 0x2, 0x1, 0xf };
 
+  // Per-format geometry, available at compile time so that sector
+  // addressing can be specialized for each format.
+  template <DiskImage::ImageFormat format>
+  struct FormatTraits;
+
+  template <> struct FormatTraits<DiskImage::ImageFormat::RAW>
+  { static constexpr DiskGeometry geometry { 256, 16, 1, 35, nullptr }; };
+
+  template <> struct FormatTraits<DiskImage::ImageFormat::THIRTEEN_SECTOR>
+  { static constexpr DiskGeometry geometry { 256, 13, 1, 35, nullptr }; };
+
+  template <> struct FormatTraits<DiskImage::ImageFormat::DOS_ORDER>
+  { static constexpr DiskGeometry geometry { 256, 16, 1, 35, dos_order_phys_to_log_table }; };
+
+  template <> struct FormatTraits<DiskImage::ImageFormat::PRODOS_ORDER>
+  { static constexpr DiskGeometry geometry { 256, 16, 1, 35, prodos_order_phys_to_log_table }; };
+
+  template <> struct FormatTraits<DiskImage::ImageFormat::CPM_ORDER>
+  { static constexpr DiskGeometry geometry { 256, 16, 1, 35, cpm_order_phys_to_log_table }; };
+
+  template <> struct FormatTraits<DiskImage::ImageFormat::APEX_ORDER>
+  { static constexpr DiskGeometry geometry { 256, 16, 1, 35, apex_order_phys_to_log_table }; };
+
   static const magic_enum::containers::array<AppleII::DiskImage::ImageFormat, AppleII::DiskGeometry> geometry
   {
-    /* RAW */             DiskGeometry { 256,  0, 1,  0, nullptr },
-    /* THIRTEEN_SECTOR */ DiskGeometry { 256, 13, 1, 35, nullptr },
-    /* DOS_ORDER */       DiskGeometry { 256, 16, 1, 35, dos_order_phys_to_log_table },
-    /* PRODOS_ORDER */    DiskGeometry { 265, 16, 1, 35, prodos_order_phys_to_log_table },
-    /* CPM_ORDER */       DiskGeometry { 256, 16, 1, 35, cpm_order_phys_to_log_table },
-    /* APEX_ORDER */      DiskGeometry { 256, 16, 1, 35, apex_order_phys_to_log_table },
+    /* RAW */             FormatTraits<DiskImage::ImageFormat::RAW>::geometry,
+    /* THIRTEEN_SECTOR */ FormatTraits<DiskImage::ImageFormat::THIRTEEN_SECTOR>::geometry,
+    /* DOS_ORDER */       FormatTraits<DiskImage::ImageFormat::DOS_ORDER>::geometry,
+    /* PRODOS_ORDER */    FormatTraits<DiskImage::ImageFormat::PRODOS_ORDER>::geometry,
+    /* CPM_ORDER */       FormatTraits<DiskImage::ImageFormat::CPM_ORDER>::geometry,
+    /* APEX_ORDER */      FormatTraits<DiskImage::ImageFormat::APEX_ORDER>::geometry,
+  };
+
+  // inverse of the deinterleave table: position within the track in
+  // the image file of each logical sector
+  template <DiskImage::ImageFormat format>
+  static constexpr auto make_file_sector_table()
+  {
+    constexpr DiskGeometry geom = FormatTraits<format>::geometry;
+    std::array<std::uint8_t, geom.sectors> table {};
+    for (std::uint8_t physical_sector = 0; physical_sector < geom.sectors; ++physical_sector)
+    {
+      table[geom.deinterleave_table[physical_sector]] = physical_sector;
+    }
+    return table;
+  }
+
+  // byte offset within the image file of a logical sector
+  template <DiskImage::ImageFormat format>
+  static constexpr std::size_t file_offset(std::size_t logical_sector)
+  {
+    constexpr DiskGeometry geom = FormatTraits<format>::geometry;
+    if constexpr (geom.deinterleave_table == nullptr)
+    {
+      return logical_sector * geom.bytes_per_sector;
+    }
+    else
+    {
+      constexpr auto file_sector_table = make_file_sector_table<format>();
+      return (((logical_sector / geom.sectors) * geom.sectors +
+	       file_sector_table[logical_sector % geom.sectors]) *
+	      geom.bytes_per_sector);
+    }
+  }
+
+  // Permute a track between file sector order and logical sector
+  // order, using the geometry's deinterleave table.
+  static void deinterleave_track(const DiskGeometry& geom,
+				 const std::uint8_t* file_data,
+				 std::uint8_t* logical_data)
+  {
+    for (std::size_t physical_sector = 0; physical_sector < geom.sectors; ++physical_sector)
+    {
+      std::memcpy(logical_data + geom.deinterleave_table[physical_sector] * geom.bytes_per_sector,
+		  file_data + physical_sector * geom.bytes_per_sector,
+		  geom.bytes_per_sector);
+    }
+  }
+
+  static void interleave_track(const DiskGeometry& geom,
+			       const std::uint8_t* logical_data,
+			       std::uint8_t* file_data)
+  {
+    for (std::size_t physical_sector = 0; physical_sector < geom.sectors; ++physical_sector)
+    {
+      std::memcpy(file_data + physical_sector * geom.bytes_per_sector,
+		  logical_data + geom.deinterleave_table[physical_sector] * geom.bytes_per_sector,
+		  geom.bytes_per_sector);
+    }
+  }
+
+  // Permute a whole image, one track at a time.
+  static void deinterleave_image(const DiskGeometry& geom,
+				 const std::uint8_t* file_data,
+				 std::uint8_t* logical_data)
+  {
+    std::size_t bytes_per_track = geom.sectors * geom.bytes_per_sector;
+    for (std::size_t track = 0; track < geom.cylinders; ++track)
+    {
+      deinterleave_track(geom,
+			 file_data + track * bytes_per_track,
+			 logical_data + track * bytes_per_track);
+    }
+  }
+
+  static void interleave_image(const DiskGeometry& geom,
+			       const std::uint8_t* logical_data,
+			       std::uint8_t* file_data)
+  {
+    std::size_t bytes_per_track = geom.sectors * geom.bytes_per_sector;
+    for (std::size_t track = 0; track < geom.cylinders; ++track)
+    {
+      interleave_track(geom,
+		       logical_data + track * bytes_per_track,
+		       file_data + track * bytes_per_track);
+    }
+  }
+
+  static bool has_gzip_magic(std::span<const std::uint8_t> data)
+  {
+    return (data.size() >= 2) && (data[0] == 0x1f) && (data[1] == 0x8b);
+  }
+
+  // zlib stream state, released when it goes out of scope
+  class ZStream
+  {
+  public:
+    enum class Direction { INFLATE, DEFLATE };
+
+    ZStream(Direction direction):
+      m_direction(direction),
+      m_stream {}
+    {
+      int result;
+      if (direction == Direction::INFLATE)
+      {
+	result = inflateInit2(&m_stream, 15 + 16);  // gzip format only
+      }
+      else
+      {
+	result = deflateInit2(&m_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+      }
+      if (result != Z_OK)
+      {
+	throw DiskError("unable to initialize zlib");
+      }
+    }
+
+    ~ZStream()
+    {
+      if (m_direction == Direction::INFLATE)
+      {
+	inflateEnd(&m_stream);
+      }
+      else
+      {
+	deflateEnd(&m_stream);
+      }
+    }
+
+    ZStream(const ZStream&) = delete;
+    ZStream& operator=(const ZStream&) = delete;
+
+    z_stream* operator->() { return &m_stream; }
+    z_stream* get() { return &m_stream; }
+
+  private:
+    Direction m_direction;
+    z_stream m_stream;
   };
 
+  static constexpr std::size_t compressed_chunk_size = 65536;
+
   DiskError::DiskError(const std::string& what):
     std::runtime_error("Apple II disk image error: " + what)
   {
@@ -44,8 +220,19 @@ namespace AppleII
 
   DiskImage::DiskImage(ImageFormat format):
     m_format(format),
-    m_image(get_bytes_per_disk(format), 0)
+    m_image(get_bytes_per_disk(format), 0),
+    m_map(nullptr),
+    m_map_size(0),
+    m_compressed(false)
+  {
+    select_sector_access();
+    // nothing has been saved yet, so everything is dirty
+    m_dirty.resize(get_bytes_per_disk(format) / geometry[format].bytes_per_sector, true);
+  }
+
+  DiskImage::~DiskImage()
   {
+    unmap();
   }
 
   const DiskGeometry& DiskImage::get_geometry(ImageFormat format)
@@ -59,6 +246,11 @@ namespace AppleII
     return geom.bytes_per_sector * geom.sectors * geom.heads * geom.cylinders;
   }
 
+  bool DiskImage::is_compressed(std::span<const std::uint8_t> data)
+  {
+    return has_gzip_magic(data);
+  }
+
   DiskImage::ImageFormat DiskImage::get_format() const
   {
     return m_format;
@@ -66,12 +258,108 @@ namespace AppleII
 
   void DiskImage::set_format(ImageFormat format)
   {
-    m_format = format;
-    m_image.resize(get_bytes_per_disk(format), 0);
+    if (m_map)
+    {
+      if (get_bytes_per_disk(format) > m_map_size)
+      {
+	throw DiskError("mapped disk image too small for format");
+      }
+      m_format = format;
+    }
+    else
+    {
+      m_format = format;
+      m_image.resize(get_bytes_per_disk(format), 0);
+    }
+    select_sector_access();
+    m_dirty.resize(get_bytes_per_disk(format) / geometry[format].bytes_per_sector);
+    m_dirty.set();
+  }
+
+  std::size_t DiskImage::get_dirty_sector_count() const
+  {
+    return m_dirty.count();
+  }
+
+  DiskImage::Backing DiskImage::get_backing() const
+  {
+    return m_map ? Backing::MAPPED : Backing::BUFFER;
+  }
+
+  void DiskImage::unmap()
+  {
+#ifndef _WIN32
+    if (m_map)
+    {
+      munmap(m_map, m_map_size);
+    }
+#endif
+    m_map = nullptr;
+    m_map_size = 0;
+  }
+
+  std::size_t DiskImage::sector_offset(std::size_t logical_sector) const
+  {
+    return m_sector_offset(logical_sector);
   }
 
-  void DiskImage::load(const std::filesystem::path& filename)
+  void DiskImage::load(const std::filesystem::path& filename,
+		       Backing backing)
   {
+    unmap();
+
+#ifndef _WIN32
+    if (backing == Backing::MAPPED)
+    {
+      int fd = ::open(filename.c_str(), O_RDONLY);
+      if (fd < 0)
+      {
+	throw DiskError("unable to open disk image to read");
+      }
+      std::array<std::uint8_t, 2> magic;
+      if (::pread(fd, magic.data(), magic.size(), 0) != static_cast<ssize_t>(magic.size()))
+      {
+	magic.fill(0);
+      }
+      struct stat st;
+      std::size_t size = get_bytes_per_disk(m_format);
+      if (has_gzip_magic(magic))
+      {
+	// can't be mapped, so read it below instead
+	::close(fd);
+      }
+      else
+      {
+	if ((fstat(fd, &st) < 0) || (static_cast<std::size_t>(st.st_size) < size))
+	{
+	  ::close(fd);
+	  throw DiskError("disk image file too short");
+	}
+	// Private mapping, so that writes only reach the file via save().
+	void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+	{
+	  throw DiskError("unable to map disk image");
+	}
+	m_map = static_cast<std::uint8_t*>(map);
+	m_map_size = size;
+	m_image.clear();
+	m_image.shrink_to_fit();
+	select_sector_access();
+	m_filename = filename;
+	m_compressed = false;
+	m_dirty.reset();
+	return;
+      }
+    }
+#else
+    (void) backing;
+#endif
+
+    m_image.resize(get_bytes_per_disk(m_format), 0);
+    select_sector_access();
+
     std::ifstream file(filename,
 		       std::ios_base::in | std::ios_base::binary);
     if (! file.is_open())
@@ -79,31 +367,281 @@ namespace AppleII
       throw DiskError("unable to open disk image to read");
     }
 
-    if (geometry[m_format].deinterleave_table)
+    std::array<std::uint8_t, 2> magic {};
+    file.read(reinterpret_cast<char*>(magic.data()), magic.size());
+    file.clear();
+    file.seekg(0);
+    m_compressed = has_gzip_magic(magic);
+    if (m_compressed)
+    {
+      std::vector<std::uint8_t> input(compressed_chunk_size);
+      decompress_image([&]()
+      {
+	file.read(reinterpret_cast<char*>(input.data()), input.size());
+	return std::span<const std::uint8_t>(input.data(), file.gcount());
+      });
+    }
+    else if (geometry[m_format].deinterleave_table)
+    {
+      // read the whole image in one call, then permute in memory
+      std::vector<std::uint8_t> file_data(m_image.size());
+      file.read(reinterpret_cast<char*>(file_data.data()), file_data.size());
+      if (file.fail())
+      {
+	throw DiskError("error reading disk image");
+      }
+      deinterleave_image(geometry[m_format], file_data.data(), m_image.data());
+    }
+    else
+    {
+      file.read(reinterpret_cast<char*>(m_image.data()), m_image.size());
+    }
+    m_filename = filename;
+    m_dirty.reset();
+  }
+
+  void DiskImage::load(std::span<const std::uint8_t> data)
+  {
+    unmap();
+
+    m_image.resize(get_bytes_per_disk(m_format), 0);
+    select_sector_access();
+
+    if (has_gzip_magic(data))
+    {
+      decompress_image([&data]()
+      {
+	return std::exchange(data, std::span<const std::uint8_t>());
+      });
+    }
+    else if (data.size() < m_image.size())
+    {
+      throw DiskError("disk image too short");
+    }
+    else if (geometry[m_format].deinterleave_table)
+    {
+      deinterleave_image(geometry[m_format], data.data(), m_image.data());
+    }
+    else
+    {
+      std::copy_n(data.begin(), m_image.size(), m_image.begin());
+    }
+    m_filename.clear();
+    m_compressed = false;
+    m_dirty.reset();
+  }
+
+  void DiskImage::decompress_image(const std::function<std::span<const std::uint8_t>()>& next_input)
+  {
+    // Each track is inflated into a track buffer and then permuted
+    // into place, or directly into place if there is no interleave.
+    // Anything in the stream beyond the image is ignored, as for an
+    // uncompressed image file.
+    const DiskGeometry& geom = geometry[m_format];
+    std::size_t bytes_per_track = geom.sectors * geom.bytes_per_sector;
+    std::vector<std::uint8_t> track_data(geom.deinterleave_table ? bytes_per_track : 0);
+
+    ZStream stream(ZStream::Direction::INFLATE);
+    int result = Z_OK;
+    for (std::size_t offset = 0; offset < m_image.size(); offset += bytes_per_track)
     {
-      for (std::uint8_t track = 0; track < geometry[m_format].cylinders; ++track)
+      std::uint8_t* dest = geom.deinterleave_table ? track_data.data() : (m_image.data() + offset);
+      stream->next_out = dest;
+      stream->avail_out = bytes_per_track;
+      while (stream->avail_out && (result != Z_STREAM_END))
       {
-	for (std::uint8_t physical_sector = 0; physical_sector < geometry[m_format].sectors; ++physical_sector)
+	if (stream->avail_in == 0)
 	{
-	  std::uint8_t logical_sector = geometry[m_format].deinterleave_table[physical_sector];
-	  std::size_t offset = (track * geometry[m_format].sectors + logical_sector) * geometry[m_format].bytes_per_sector;
-	  std::uint8_t* data = m_image.data() + offset;
-	  file.read(reinterpret_cast<char*>(data), geometry[m_format].bytes_per_sector);
-	  if (file.fail())
+	  std::span<const std::uint8_t> input = next_input();
+	  if (input.empty())
 	  {
-	    throw DiskError("error reading disk iamge");
+	    break;
 	  }
+	  stream->next_in = const_cast<Bytef*>(input.data());
+	  stream->avail_in = input.size();
+	}
+	result = inflate(stream.get(), Z_NO_FLUSH);
+	if ((result != Z_OK) && (result != Z_STREAM_END))
+	{
+	  throw DiskError("error decompressing disk image");
 	}
       }
+      if (stream->avail_out)
+      {
+	throw DiskError("disk image too short");
+      }
+      if (geom.deinterleave_table)
+      {
+	deinterleave_track(geom, track_data.data(), m_image.data() + offset);
+      }
     }
-    else
+  }
+
+  void DiskImage::save(const std::filesystem::path& filename,
+		       SaveMode mode)
+  {
+    bool compress = ((filename.extension() == ".gz") ||
+		     (m_compressed && (filename == m_filename)));
+    switch (mode)
     {
-      file.read(reinterpret_cast<char*>(m_image.data()), m_image.size());
+    case SaveMode::IN_PLACE:
+      if ((! compress) && write_dirty_sectors(filename))
+      {
+	break;
+      }
+      write_file(filename, compress);
+      break;
+    case SaveMode::SAFE:
+      {
+	// The new image must be on storage before the rename, and the
+	// rename must be on storage before the image is considered
+	// saved, or a crash could leave an empty or partial image.
+	std::filesystem::path temp_filename = utility::create_temp_file(filename);
+	std::error_code ec;
+	try
+	{
+	  write_file(temp_filename, compress);
+	  utility::sync_to_storage(temp_filename, false);
+	  std::filesystem::rename(temp_filename, filename, ec);
+	  if (ec)
+	  {
+	    throw DiskError("unable to rename temporary disk image");
+	  }
+	}
+	catch (...)
+	{
+	  std::filesystem::remove(temp_filename, ec);
+	  throw;
+	}
+	std::filesystem::path dir = filename.parent_path();
+	utility::sync_to_storage(dir.empty() ? std::filesystem::path(".") : dir, true);
+      }
+      break;
+    case SaveMode::FULL:
+      write_file(filename, compress);
+      break;
+    }
+    m_filename = filename;
+    m_compressed = compress;
+    m_dirty.reset();
+  }
+
+  bool DiskImage::write_dirty_sectors(const std::filesystem::path& filename) const
+  {
+    std::error_code ec;
+    if (m_filename.empty() ||
+	m_compressed ||
+	(! std::filesystem::equivalent(filename, m_filename, ec)) ||
+	(std::filesystem::file_size(filename, ec) != get_bytes_per_disk(m_format)))
+    {
+      return false;
+    }
+
+    // file offsets of the dirty sectors, in file order, so that
+    // adjacent sectors can be written together
+    std::size_t bytes_per_sector = geometry[m_format].bytes_per_sector;
+    std::vector<std::pair<std::size_t, const std::uint8_t*>> dirty;
+    for (std::size_t logical_sector = m_dirty.find_first();
+	 logical_sector != boost::dynamic_bitset<>::npos;
+	 logical_sector = m_dirty.find_next(logical_sector))
+    {
+      std::size_t file_offset = sector_offset(logical_sector);
+      const std::uint8_t* data = m_map ? (m_map + file_offset) : (m_image.data() + logical_sector * bytes_per_sector);
+      dirty.emplace_back(file_offset, data);
+    }
+    std::sort(dirty.begin(), dirty.end());
+
+#ifndef _WIN32
+    int fd = ::open(filename.c_str(), O_WRONLY);
+    if (fd < 0)
+    {
+      throw DiskError("unable to open disk image to write");
+    }
+    std::vector<struct iovec> iov;
+    for (std::size_t i = 0; i < dirty.size(); )
+    {
+      std::size_t run_offset = dirty[i].first;
+      iov.clear();
+      do
+      {
+	iov.push_back({ const_cast<std::uint8_t*>(dirty[i].second), bytes_per_sector });
+	++i;
+      }
+      while ((i < dirty.size()) &&
+	     (dirty[i].first == run_offset + iov.size() * bytes_per_sector));
+      ssize_t count = pwritev(fd, iov.data(), iov.size(), run_offset);
+      if (count != static_cast<ssize_t>(iov.size() * bytes_per_sector))
+      {
+	::close(fd);
+	throw DiskError("error writing disk image");
+      }
+    }
+    if (::close(fd) < 0)
+    {
+      throw DiskError("error writing disk image");
+    }
+#else
+    std::fstream file(filename,
+		      std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    if (! file.is_open())
+    {
+      throw DiskError("unable to open disk image to write");
+    }
+    for (const auto& [file_offset, data]: dirty)
+    {
+      file.seekp(file_offset);
+      file.write(reinterpret_cast<const char*>(data), bytes_per_sector);
     }
+    file.close();
+    if (file.fail())
+    {
+      throw DiskError("error writing disk image");
+    }
+#endif
+    return true;
   }
 
-  void DiskImage::save(const std::filesystem::path& filename) const
+  void DiskImage::write_file(const std::filesystem::path& filename,
+			     bool compress) const
   {
+    if (compress)
+    {
+      write_compressed_file(filename);
+      return;
+    }
+
+#ifndef _WIN32
+    if (m_map)
+    {
+      // The map is already in file order. Don't truncate the file, as
+      // it may be the one that is mapped.
+      int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT, 0666);
+      if (fd < 0)
+      {
+	throw DiskError("unable to open disk image to write");
+      }
+      std::size_t offset = 0;
+      while (offset < m_map_size)
+      {
+	ssize_t count = ::write(fd, m_map + offset, m_map_size - offset);
+	if (count <= 0)
+	{
+	  ::close(fd);
+	  throw DiskError("error writing disk image");
+	}
+	offset += count;
+      }
+      // close the file even if truncating it failed
+      bool truncated = (ftruncate(fd, m_map_size) == 0);
+      bool closed = (::close(fd) == 0);
+      if (! (truncated && closed))
+      {
+	throw DiskError("error writing disk image");
+      }
+      return;
+    }
+#endif
+
     std::ofstream file(filename,
 		       std::ios_base::out | std::ios_base::binary);
     if (! file.is_open())
@@ -113,24 +651,171 @@ namespace AppleII
 
     if (geometry[m_format].deinterleave_table)
     {
-      for (std::uint8_t track = 0; track < geometry[m_format].cylinders; ++track)
+      // permute in memory, then write the whole image in one call
+      std::vector<std::uint8_t> file_data(m_image.size());
+      interleave_image(geometry[m_format], m_image.data(), file_data.data());
+      file.write(reinterpret_cast<const char*>(file_data.data()), file_data.size());
+    }
+    else
+    {
+      file.write(reinterpret_cast<const char*>(m_image.data()), m_image.size());
+    }
+    if (file.fail())
+    {
+      throw DiskError("error writing disk image");
+    }
+  }
+
+  void DiskImage::write_compressed_file(const std::filesystem::path& filename) const
+  {
+    std::ofstream file(filename,
+		       std::ios_base::out | std::ios_base::binary);
+    if (! file.is_open())
+    {
+      throw DiskError("unable to open disk image to write");
+    }
+
+    // Deflate a track at a time, in file order: the map is already in
+    // file order, and otherwise each track is permuted into a track
+    // buffer first.
+    const DiskGeometry& geom = geometry[m_format];
+    std::size_t bytes_per_track = geom.sectors * geom.bytes_per_sector;
+    std::size_t image_size = get_bytes_per_disk(m_format);
+    std::vector<std::uint8_t> track_data(bytes_per_track);
+    std::vector<std::uint8_t> output(compressed_chunk_size);
+
+    ZStream stream(ZStream::Direction::DEFLATE);
+    for (std::size_t offset = 0; offset < image_size; offset += bytes_per_track)
+    {
+      const std::uint8_t* source;
+      if (m_map)
+      {
+	source = m_map + offset;
+      }
+      else if (geom.deinterleave_table)
+      {
+	interleave_track(geom, m_image.data() + offset, track_data.data());
+	source = track_data.data();
+      }
+      else
+      {
+	source = m_image.data() + offset;
+      }
+      stream->next_in = const_cast<Bytef*>(source);
+      stream->avail_in = bytes_per_track;
+      int flush = ((offset + bytes_per_track) < image_size) ? Z_NO_FLUSH : Z_FINISH;
+      do
       {
-	for (std::uint8_t physical_sector = 0; physical_sector < geometry[m_format].sectors; ++physical_sector)
+	stream->next_out = output.data();
+	stream->avail_out = output.size();
+	if (deflate(stream.get(), flush) == Z_STREAM_ERROR)
 	{
-	  std::uint8_t logical_sector = geometry[m_format].deinterleave_table[physical_sector];
-	  std::size_t offset = (track * geometry[m_format].sectors + logical_sector) * geometry[m_format].bytes_per_sector;
-	  const std::uint8_t* data = m_image.data() + offset;
-	  file.write(reinterpret_cast<const char*>(data), geometry[m_format].bytes_per_sector);
-	  if (file.fail())
-	  {
-	    throw DiskError("error writing disk iamge");
-	  }
+	  throw DiskError("error compressing disk image");
 	}
+	file.write(reinterpret_cast<const char*>(output.data()), output.size() - stream->avail_out);
+      }
+      while (stream->avail_out == 0);
+    }
+    file.close();
+    if (file.fail())
+    {
+      throw DiskError("error writing disk image");
+    }
+  }
+
+  template <DiskImage::ImageFormat format>
+  void DiskImage::set_sector_access()
+  {
+    m_sector_offset = &file_offset<format>;
+    if (m_map)
+    {
+      m_sector_reader = &DiskImage::read_specialized<format, true>;
+      m_sector_writer = &DiskImage::write_specialized<format, true>;
+    }
+    else
+    {
+      m_sector_reader = &DiskImage::read_specialized<format, false>;
+      m_sector_writer = &DiskImage::write_specialized<format, false>;
+    }
+  }
+
+  void DiskImage::select_sector_access()
+  {
+    switch (m_format)
+    {
+    case ImageFormat::RAW:             set_sector_access<ImageFormat::RAW>();             break;
+    case ImageFormat::THIRTEEN_SECTOR: set_sector_access<ImageFormat::THIRTEEN_SECTOR>(); break;
+    case ImageFormat::DOS_ORDER:       set_sector_access<ImageFormat::DOS_ORDER>();       break;
+    case ImageFormat::PRODOS_ORDER:    set_sector_access<ImageFormat::PRODOS_ORDER>();    break;
+    case ImageFormat::CPM_ORDER:       set_sector_access<ImageFormat::CPM_ORDER>();       break;
+    case ImageFormat::APEX_ORDER:      set_sector_access<ImageFormat::APEX_ORDER>();      break;
+    }
+  }
+
+  template <DiskImage::ImageFormat format, bool mapped>
+  void DiskImage::read_specialized(const DiskImage& image,
+				   std::size_t track,
+				   std::size_t head,
+				   std::size_t sector,
+				   std::size_t sector_count,
+				   std::uint8_t* data)
+  {
+    constexpr DiskGeometry geom = FormatTraits<format>::geometry;
+    constexpr std::size_t sectors_per_disk = geom.sectors * geom.heads * geom.cylinders;
+    std::size_t logical_sector = (track * geom.heads + head) * geom.sectors + sector;
+    if ((logical_sector + sector_count) > sectors_per_disk)
+    {
+      throw DiskError("read beyond end of disk image");
+    }
+    if constexpr (mapped && (geom.deinterleave_table != nullptr))
+    {
+      for (std::size_t i = 0; i < sector_count; i++)
+      {
+	std::memcpy(data + i * geom.bytes_per_sector,
+		    image.m_map + file_offset<format>(logical_sector + i),
+		    geom.bytes_per_sector);
       }
     }
     else
     {
-      file.write(reinterpret_cast<const char*>(m_image.data()), m_image.size());
+      const std::uint8_t* base = mapped ? image.m_map : image.m_image.data();
+      std::memcpy(data,
+		  base + logical_sector * geom.bytes_per_sector,
+		  sector_count * geom.bytes_per_sector);
+    }
+  }
+
+  template <DiskImage::ImageFormat format, bool mapped>
+  void DiskImage::write_specialized(DiskImage& image,
+				    std::size_t track,
+				    std::size_t head,
+				    std::size_t sector,
+				    std::size_t sector_count,
+				    const std::uint8_t* data)
+  {
+    constexpr DiskGeometry geom = FormatTraits<format>::geometry;
+    constexpr std::size_t sectors_per_disk = geom.sectors * geom.heads * geom.cylinders;
+    std::size_t logical_sector = (track * geom.heads + head) * geom.sectors + sector;
+    if ((logical_sector + sector_count) > sectors_per_disk)
+    {
+      throw DiskError("write beyond end of disk image");
+    }
+    image.m_dirty.set(logical_sector, sector_count, true);
+    if constexpr (mapped && (geom.deinterleave_table != nullptr))
+    {
+      for (std::size_t i = 0; i < sector_count; i++)
+      {
+	std::memcpy(image.m_map + file_offset<format>(logical_sector + i),
+		    data + i * geom.bytes_per_sector,
+		    geom.bytes_per_sector);
+      }
+    }
+    else
+    {
+      std::uint8_t* base = mapped ? image.m_map : image.m_image.data();
+      std::memcpy(base + logical_sector * geom.bytes_per_sector,
+		  data,
+		  sector_count * geom.bytes_per_sector);
     }
   }
 
@@ -140,13 +825,7 @@ namespace AppleII
 		       std::size_t sector_count,
 		       std::uint8_t* data) const
   {
-    std::size_t byte_offset = ((track * geometry[m_format].heads + head) * geometry[m_format].sectors + sector) * geometry[m_format].bytes_per_sector;
-    std::size_t byte_count = sector_count * geometry[m_format].bytes_per_sector;
-    if ((byte_offset + byte_count) >= m_image.size())
-    {
-      throw DiskError("read beyond end of disk image");
-    }
-    std::memcpy(data, m_image.data() + byte_offset, byte_count);
+    m_sector_reader(*this, track, head, sector, sector_count, data);
   }
 
   void DiskImage::write(std::uint8_t track,
@@ -155,13 +834,109 @@ namespace AppleII
 			std::size_t sector_count,
 			const std::uint8_t* data)
   {
-    std::size_t byte_offset = ((track * geometry[m_format].heads + head) * geometry[m_format].sectors + sector) * geometry[m_format].bytes_per_sector;
-    std::size_t byte_count = sector_count * geometry[m_format].bytes_per_sector;
-    if ((byte_offset + byte_count) >= m_image.size())
+    m_sector_writer(*this, track, head, sector, sector_count, data);
+  }
+
+  template <typename Span>
+  static void append_span(std::vector<Span>& spans,
+			  typename Span::pointer data,
+			  std::size_t size)
+  {
+    if (size == 0)
+    {
+      return;
+    }
+    if ((! spans.empty()) && (spans.back().data() + spans.back().size() == data))
+    {
+      spans.back() = Span(spans.back().data(), spans.back().size() + size);
+    }
+    else
+    {
+      spans.emplace_back(data, size);
+    }
+  }
+
+  void DiskImage::get_sector_spans(std::size_t logical_sector,
+				   std::size_t sector_count,
+				   std::vector<std::span<const std::uint8_t>>& spans) const
+  {
+    const DiskGeometry& geom = geometry[m_format];
+    if ((logical_sector + sector_count) > m_dirty.size())
+    {
+      throw DiskError("read beyond end of disk image");
+    }
+    if (! m_map)
+    {
+      append_span(spans, m_image.data() + logical_sector * geom.bytes_per_sector, sector_count * geom.bytes_per_sector);
+      return;
+    }
+    for (std::size_t i = 0; i < sector_count; i++)
+    {
+      append_span(spans, m_map + sector_offset(logical_sector + i), geom.bytes_per_sector);
+    }
+  }
+
+  void DiskImage::get_writable_sector_spans(std::size_t logical_sector,
+					    std::size_t sector_count,
+					    std::vector<std::span<std::uint8_t>>& spans)
+  {
+    const DiskGeometry& geom = geometry[m_format];
+    if ((logical_sector + sector_count) > m_dirty.size())
     {
       throw DiskError("write beyond end of disk image");
     }
-    std::memcpy(m_image.data() + byte_offset, data, byte_count);
+    m_dirty.set(logical_sector, sector_count, true);
+    if (! m_map)
+    {
+      append_span(spans, m_image.data() + logical_sector * geom.bytes_per_sector, sector_count * geom.bytes_per_sector);
+      return;
+    }
+    for (std::size_t i = 0; i < sector_count; i++)
+    {
+      append_span(spans, m_map + sector_offset(logical_sector + i), geom.bytes_per_sector);
+    }
+  }
+
+  const std::filesystem::path& DiskImage::get_filename() const
+  {
+    return m_filename;
+  }
+
+  std::optional<std::uintmax_t> DiskImage::get_clean_file_offset(std::size_t logical_sector,
+								   std::size_t sector_count) const
+  {
+    const DiskGeometry& geom = geometry[m_format];
+    if (m_filename.empty() ||
+	m_compressed ||
+	(sector_count == 0) ||
+	((logical_sector + sector_count) > m_dirty.size()))
+    {
+      return std::nullopt;
+    }
+    std::size_t first_offset = sector_offset(logical_sector);
+    for (std::size_t i = 0; i < sector_count; i++)
+    {
+      if (m_dirty.test(logical_sector + i) ||
+	  (sector_offset(logical_sector + i) != first_offset + i * geom.bytes_per_sector))
+      {
+	return std::nullopt;
+      }
+    }
+    return first_offset;
+  }
+
+  void DiskImage::read_logical(std::size_t logical_sector,
+			       std::size_t sector_count,
+			       std::uint8_t* data) const
+  {
+    m_sector_reader(*this, 0, 0, logical_sector, sector_count, data);
+  }
+
+  void DiskImage::write_logical(std::size_t logical_sector,
+				std::size_t sector_count,
+				const std::uint8_t* data)
+  {
+    m_sector_writer(*this, 0, 0, logical_sector, sector_count, data);
   }
 
 } // end namespace AppleII
@@ -8,9 +8,14 @@
 
 #include <cstdint>
 #include <filesystem>
+#include <functional>
+#include <optional>
+#include <span>
 #include <stdexcept>
 #include <vector>
 
+#include <boost/dynamic_bitset.hpp>
+
 #include <magic_enum.hpp>
 #include <magic_enum_containers.hpp>
 
@@ -42,16 +47,58 @@ namespace AppleII
       APEX_ORDER,      // XXX HACK ALERT - 2:1 sector interleave, but read in DOS order?
     };
 
+    enum class Backing
+    {
+      BUFFER,  // image file copied into memory, in logical sector order
+      MAPPED,  // image file memory-mapped copy-on-write, accessed in place
+    };
+
+    enum class SaveMode
+    {
+      FULL,      // rewrite the whole image file
+      IN_PLACE,  // write only modified sectors into the existing image file
+      SAFE,      // write a temporary file, then rename it over the image file
+    };
+
     DiskImage(ImageFormat format = ImageFormat::DOS_ORDER);
+    ~DiskImage();
+
+    DiskImage(const DiskImage&) = delete;
+    DiskImage& operator=(const DiskImage&) = delete;
 
     static const DiskGeometry& get_geometry(ImageFormat format);
     static std::size_t get_bytes_per_disk(ImageFormat format);
 
+    // whether the start of an image file has the gzip magic number,
+    // so that load() will decompress it
+    static bool is_compressed(std::span<const std::uint8_t> data);
+
     ImageFormat get_format() const;
     void set_format(ImageFormat format);
 
-    void load(const std::filesystem::path& filename);
-    void save(const std::filesystem::path& filename) const;
+    Backing get_backing() const;
+
+    // MAPPED backing is only available on POSIX hosts; elsewhere it
+    // silently falls back to BUFFER. A gzip compressed image, as
+    // recognized by its magic number, is decompressed as it is read,
+    // and always has BUFFER backing.
+    void load(const std::filesystem::path& filename,
+	      Backing backing = Backing::BUFFER);
+
+    // Load from an image file held in memory, such as a member of an
+    // archive, with BUFFER backing. The image has no file, so it can
+    // only be saved in FULL or SAFE mode.
+    void load(std::span<const std::uint8_t> data);
+
+    // IN_PLACE falls back to FULL if filename isn't the file most
+    // recently loaded or saved. The image is gzip compressed if
+    // filename ends in ".gz", or is the compressed file most recently
+    // loaded or saved; a compressed image is always written in full.
+    void save(const std::filesystem::path& filename,
+	      SaveMode mode = SaveMode::FULL);
+
+    // number of sectors modified since the last load or save
+    std::size_t get_dirty_sector_count() const;
 
     void read(std::uint8_t track,
 	      std::uint8_t head,
@@ -65,9 +112,108 @@ namespace AppleII
 	       std::size_t sector_count,
 	       const std::uint8_t* data);
 
+    // Access by logical sector number (track * sectors + sector),
+    // for callers that don't care about tracks.
+    void read_logical(std::size_t logical_sector,
+		      std::size_t sector_count,
+		      std::uint8_t* data) const;
+
+    void write_logical(std::size_t logical_sector,
+		       std::size_t sector_count,
+		       const std::uint8_t* data);
+
+    // Append the in-memory locations of a range of logical sectors to
+    // spans, in logical order, merging sectors that are adjacent in
+    // memory, so that the range can be handed to scatter/gather I/O
+    // without an intermediate copy. The spans are valid until the
+    // image is next loaded or its format changed. The writable form
+    // marks the sectors modified.
+    void get_sector_spans(std::size_t logical_sector,
+			  std::size_t sector_count,
+			  std::vector<std::span<const std::uint8_t>>& spans) const;
+
+    void get_writable_sector_spans(std::size_t logical_sector,
+				   std::size_t sector_count,
+				   std::vector<std::span<std::uint8_t>>& spans);
+
+    // file most recently loaded or saved, empty if none
+    const std::filesystem::path& get_filename() const;
+
+    // If a range of logical sectors is stored contiguously in that
+    // file, uncompressed, and hasn't been modified since, the byte
+    // offset of the range within the file, so that it can be copied
+    // from the file directly.
+    std::optional<std::uintmax_t> get_clean_file_offset(std::size_t logical_sector,
+							 std::size_t sector_count) const;
+
   protected:
+    // Sector access is specialized at compile time for each format
+    // and backing, and selected once whenever either changes, so
+    // that per-access address arithmetic uses constant geometry.
+    using SectorReader = void (*)(const DiskImage& image,
+				  std::size_t track,
+				  std::size_t head,
+				  std::size_t sector,
+				  std::size_t sector_count,
+				  std::uint8_t* data);
+    using SectorWriter = void (*)(DiskImage& image,
+				  std::size_t track,
+				  std::size_t head,
+				  std::size_t sector,
+				  std::size_t sector_count,
+				  const std::uint8_t* data);
+    using SectorOffset = std::size_t (*)(std::size_t logical_sector);
+
+    template <ImageFormat format, bool mapped>
+    static void read_specialized(const DiskImage& image,
+				 std::size_t track,
+				 std::size_t head,
+				 std::size_t sector,
+				 std::size_t sector_count,
+				 std::uint8_t* data);
+
+    template <ImageFormat format, bool mapped>
+    static void write_specialized(DiskImage& image,
+				  std::size_t track,
+				  std::size_t head,
+				  std::size_t sector,
+				  std::size_t sector_count,
+				  const std::uint8_t* data);
+
+    template <ImageFormat format>
+    void set_sector_access();
+    void select_sector_access();
+
+    void unmap();
+    std::size_t sector_offset(std::size_t logical_sector) const;
+    void write_file(const std::filesystem::path& filename,
+		    bool compress) const;
+    void write_compressed_file(const std::filesystem::path& filename) const;
+    bool write_dirty_sectors(const std::filesystem::path& filename) const;
+
+    // Decompress a gzip stream into the image, a track at a time, in
+    // logical order. next_input returns the next part of the stream,
+    // or an empty span at its end.
+    void decompress_image(const std::function<std::span<const std::uint8_t>()>& next_input);
+
     ImageFormat m_format;
     std::vector<std::uint8_t> m_image;
+    SectorReader m_sector_reader;
+    SectorWriter m_sector_writer;
+    SectorOffset m_sector_offset;
+
+    // When MAPPED, m_map holds the image file in file (interleaved)
+    // order. m_sector_offset gives the byte offset within the image
+    // file of a logical sector, using the same per-format mapping as
+    // the specialized sector reader and writer.
+    std::uint8_t* m_map;
+    std::size_t m_map_size;
+
+    // file most recently loaded or saved, whether it is compressed,
+    // and logical sectors modified since then
+    std::filesystem::path m_filename;
+    bool m_compressed;
+    boost::dynamic_bitset<> m_dirty;
   };
 
 } // end namespace AppleII
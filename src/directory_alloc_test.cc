@@ -0,0 +1,143 @@
+// directory_alloc_test.cc
+//
+// Copyright 2025 Eric Smith
+// SPDX-License-Identifier: GPL-3.0-only
+
+// Checks that Apex::Directory doesn't allocate heap memory once it has
+// been constructed, by counting calls to the global operator new.
+
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "apex_disk.hh"
+
+static std::size_t allocation_count = 0;
+
+void* operator new(std::size_t size)
+{
+  ++allocation_count;
+  if (void* p = std::malloc(size ? size : 1))
+  {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+static bool failed = false;
+
+// what is a string_view, so that checks don't allocate themselves
+static void check(bool condition, std::string_view what)
+{
+  if (! condition)
+  {
+    std::cerr << std::format("FAILED: {}\n", what);
+    failed = true;
+  }
+}
+
+// Run operation, checking that it makes no allocations.
+template <typename Operation>
+static void check_no_allocation(const std::string& what, Operation operation)
+{
+  std::size_t before = allocation_count;
+  operation();
+  std::size_t count = allocation_count - before;
+  check(count == 0, std::format("{} made {} allocations", what, count));
+}
+
+int main()
+{
+  Apex::Disk disk(AppleII::DiskImage::ImageFormat::DOS_ORDER);
+  disk.initialize(560, 1);
+
+  // filenames and dates are built before counting starts
+  std::vector<Apex::Filename> filenames;
+  for (std::size_t i = 0; i < Apex::ENTRIES_PER_DIRECTORY; i++)
+  {
+    filenames.emplace_back(std::format("FILE{}.DAT", i));
+  }
+  const Apex::Filename missing("MISSING.DAT");
+  const Apex::Date date(2025, 1, 1);
+
+  Apex::Directory dir = disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
+
+  check_no_allocation("replace", [&]()
+  {
+    for (const Apex::Filename& filename: filenames)
+    {
+      Apex::DirectoryEntry& entry = dir.allocate_directory_entry();
+      std::uint16_t first_block = dir.find_free_blocks(2);
+      entry.replace(Apex::DirectoryEntry::Status::VALID, filename, first_block, first_block + 1, date);
+    }
+  });
+  check(dir.valid_count() == filenames.size(), "directory not full after replace");
+
+  check_no_allocation("iteration", [&]()
+  {
+    std::size_t count = 0;
+    for (const Apex::DirectoryEntry& entry: dir)
+    {
+      count += entry.get_status() == Apex::DirectoryEntry::Status::VALID;
+    }
+    for (const Apex::DirectoryEntry& entry: dir.valid_entries())
+    {
+      count -= entry.get_block_count() == 2;
+    }
+    check(count == 0, "iteration counts differ");
+  });
+
+  check_no_allocation("find", [&]()
+  {
+    check(dir.find(filenames.back()) != nullptr, "find of existing file failed");
+    check(dir.find(missing) == nullptr, "find of missing file succeeded");
+  });
+
+  check_no_allocation("delete_file", [&]()
+  {
+    for (std::size_t i = 0; i < filenames.size(); i += 2)
+    {
+      dir.find(filenames[i])->delete_file();
+    }
+  });
+  check(dir.valid_count() == filenames.size() / 2, "wrong file count after delete_file");
+
+  check_no_allocation("replace after delete_file", [&]()
+  {
+    for (std::size_t i = 0; i < filenames.size(); i += 2)
+    {
+      Apex::DirectoryEntry& entry = dir.allocate_directory_entry();
+      std::uint16_t first_block = dir.find_free_blocks(1, Apex::AllocationPolicy::BEST_FIT);
+      entry.replace(Apex::DirectoryEntry::Status::VALID, filenames[i], first_block, first_block, date);
+    }
+  });
+  check(dir.check_consistency(), "directory inconsistent");
+
+  // an empty file is stored with its last block just before its first
+  dir.find(filenames[0])->delete_file();
+  Apex::DirectoryEntry& empty_entry = dir.allocate_directory_entry();
+  std::uint16_t empty_first_block = dir.find_free_blocks(0);
+  empty_entry.replace(Apex::DirectoryEntry::Status::VALID, filenames[0], empty_first_block, empty_first_block - 1, date);
+  check(dir.check_consistency(), "directory with empty file inconsistent");
+
+  if (failed)
+  {
+    return 1;
+  }
+  std::cout << "directory_alloc_test passed\n";
+  return 0;
+}
@@ -0,0 +1,265 @@
+// host_file.cc
+//
+// Copyright 2025 Eric Smith
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <format>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <climits>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "host_file.hh"
+
+namespace utility
+{
+  HostFileError::HostFileError(const std::string& what):
+    std::runtime_error(what)
+  {
+  }
+
+  static constexpr std::size_t small_span_size = 4096;
+
+#ifdef _WIN32
+  static constexpr int open_flags = O_BINARY;
+#else
+  static constexpr int open_flags = 0;
+  static constexpr std::size_t max_iov = IOV_MAX;
+#endif
+
+  HostFile::HostFile(const std::filesystem::path& filename, Mode mode):
+    m_filename(filename),
+    m_close(true)
+  {
+    if (mode == Mode::READ)
+    {
+      m_fd = ::open(filename.string().c_str(), O_RDONLY | open_flags);
+    }
+    else
+    {
+      m_fd = ::open(filename.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC | open_flags, 0666);
+    }
+    if (m_fd < 0)
+    {
+      throw HostFileError(std::format("unable to open host file \"{}\" to {}",
+				      filename.string(),
+				      (mode == Mode::READ) ? "read" : "write"));
+    }
+  }
+
+  HostFile::HostFile(Mode mode):
+    m_close(false)
+  {
+    if (mode == Mode::READ)
+    {
+      m_filename = "standard input";
+      m_fd = 0;
+    }
+    else
+    {
+      m_filename = "standard output";
+      m_fd = 1;
+    }
+#ifdef _WIN32
+    ::_setmode(m_fd, _O_BINARY);
+#endif
+  }
+
+  HostFile::~HostFile()
+  {
+    if (m_close)
+    {
+      ::close(m_fd);
+    }
+  }
+
+  std::uintmax_t HostFile::get_size() const
+  {
+    struct stat st;
+    if (fstat(m_fd, &st) < 0)
+    {
+      throw HostFileError(std::format("unable to get size of host file \"{}\"", m_filename.string()));
+    }
+    return st.st_size;
+  }
+
+  void HostFile::write(const std::vector<std::span<const std::uint8_t>>& spans)
+  {
+    // Many small spans, such as the sectors of an interleaved image,
+    // are copied together first: per-segment overhead in the host
+    // makes writev() of 256-byte segments slower than the copy.
+    std::size_t total = 0;
+    for (std::span<const std::uint8_t> span: spans)
+    {
+      total += span.size();
+    }
+    if (total == 0)
+    {
+      return;
+    }
+    if ((spans.size() > 1) && (total < spans.size() * small_span_size))
+    {
+      std::vector<std::uint8_t> staging;
+      staging.reserve(total);
+      for (std::span<const std::uint8_t> span: spans)
+      {
+	staging.insert(staging.end(), span.begin(), span.end());
+      }
+      write({ std::span<const std::uint8_t>(staging) });
+      return;
+    }
+
+    std::size_t index = 0;
+    std::size_t done = 0;  // bytes of spans[index] already written
+    while (index < spans.size())
+    {
+#ifdef _WIN32
+      long result = ::_write(m_fd, spans[index].data() + done, spans[index].size() - done);
+#else
+      std::array<struct iovec, 1024> iov;
+      std::size_t iov_count = std::min({ spans.size() - index, iov.size(), max_iov });
+      for (std::size_t i = 0; i < iov_count; i++)
+      {
+	iov[i] = { const_cast<std::uint8_t*>(spans[index + i].data()), spans[index + i].size() };
+      }
+      iov[0].iov_base = static_cast<std::uint8_t*>(iov[0].iov_base) + done;
+      iov[0].iov_len -= done;
+      long result = ::writev(m_fd, iov.data(), iov_count);
+#endif
+      if (result <= 0)
+      {
+	if ((result < 0) && (errno == EINTR))
+	{
+	  continue;
+	}
+	throw HostFileError(std::format("error writing host file \"{}\"", m_filename.string()));
+      }
+      // advance past the spans completely written
+      std::size_t count = result + done;
+      while ((index < spans.size()) && (count >= spans[index].size()))
+      {
+	count -= spans[index].size();
+	++index;
+      }
+      done = count;
+    }
+  }
+
+  std::size_t HostFile::read(const std::vector<std::span<std::uint8_t>>& spans)
+  {
+    std::size_t total = 0;
+    std::size_t index = 0;
+    std::size_t done = 0;  // bytes of spans[index] already read
+    while (index < spans.size())
+    {
+#ifdef _WIN32
+      long result = ::_read(m_fd, spans[index].data() + done, spans[index].size() - done);
+#else
+      std::array<struct iovec, 1024> iov;
+      std::size_t iov_count = std::min({ spans.size() - index, iov.size(), max_iov });
+      for (std::size_t i = 0; i < iov_count; i++)
+      {
+	iov[i] = { spans[index + i].data(), spans[index + i].size() };
+      }
+      iov[0].iov_base = static_cast<std::uint8_t*>(iov[0].iov_base) + done;
+      iov[0].iov_len -= done;
+      long result = ::readv(m_fd, iov.data(), iov_count);
+#endif
+      if (result < 0)
+      {
+	if (errno == EINTR)
+	{
+	  continue;
+	}
+	throw HostFileError(std::format("error reading host file \"{}\"", m_filename.string()));
+      }
+      if (result == 0)
+      {
+	break;  // end of file
+      }
+      total += result;
+      std::size_t count = result + done;
+      while ((index < spans.size()) && (count >= spans[index].size()))
+      {
+	count -= spans[index].size();
+	++index;
+      }
+      done = count;
+    }
+    return total;
+  }
+
+  void HostFile::copy_from(const HostFile& source,
+			   std::uintmax_t offset,
+			   std::size_t size)
+  {
+#ifdef __linux__
+    // Copy within the kernel; some filesystems can share the extent
+    // rather than copy it. Falls back to copying through a buffer if
+    // the host can't do it for this pair of files, including when the
+    // output was opened for append (EBADF), as by a shell's ">>".
+    loff_t source_offset = offset;
+    while (size)
+    {
+      ssize_t count = ::copy_file_range(source.m_fd, &source_offset, m_fd, nullptr, size, 0);
+      if (count < 0)
+      {
+	if (errno == EINTR)
+	{
+	  continue;
+	}
+	if ((errno == ENOSYS) || (errno == EXDEV) || (errno == EINVAL) || (errno == EOPNOTSUPP) || (errno == EBADF))
+	{
+	  break;
+	}
+	throw HostFileError(std::format("error copying host file \"{}\" to \"{}\"",
+					source.m_filename.string(),
+					m_filename.string()));
+      }
+      if (count == 0)
+      {
+	throw HostFileError(std::format("premature eof reading host file \"{}\"", source.m_filename.string()));
+      }
+      size -= count;
+    }
+    offset = source_offset;
+#endif
+
+    std::array<std::uint8_t, 16384> buffer;
+    while (size)
+    {
+      std::size_t chunk = std::min(size, buffer.size());
+#ifdef _WIN32
+      long count = -1;
+      if (::_lseeki64(source.m_fd, offset, SEEK_SET) >= 0)
+      {
+	count = ::_read(source.m_fd, buffer.data(), chunk);
+      }
+#else
+      long count = ::pread(source.m_fd, buffer.data(), chunk, offset);
+#endif
+      if (count <= 0)
+      {
+	if ((count < 0) && (errno == EINTR))
+	{
+	  continue;
+	}
+	throw HostFileError(std::format("error reading host file \"{}\"", source.m_filename.string()));
+      }
+      write({ std::span<const std::uint8_t>(buffer.data(), count) });
+      offset += count;
+      size -= count;
+    }
+  }
+
+} // end namespace utility
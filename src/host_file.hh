@@ -0,0 +1,66 @@
+// host_file.hh
+//
+// Copyright 2025 Eric Smith
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef HOST_FILE_HH
+#define HOST_FILE_HH
+
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+namespace utility
+{
+  struct HostFileError: public std::runtime_error
+  { HostFileError(const std::string& what); };
+
+  // Unbuffered host file, for moving whole extents between a host file
+  // and a disk image in as few system calls as possible.
+  class HostFile
+  {
+  public:
+    enum class Mode
+    {
+      READ,
+      WRITE,  // create, or truncate if it exists
+    };
+
+    HostFile(const std::filesystem::path& filename, Mode mode);
+
+    // standard input for READ, standard output for WRITE, in binary
+    // mode; left open when destroyed
+    explicit HostFile(Mode mode);
+
+    ~HostFile();
+
+    HostFile(const HostFile&) = delete;
+    HostFile& operator=(const HostFile&) = delete;
+
+    std::uintmax_t get_size() const;
+
+    // gather write of the spans, in order
+    void write(const std::vector<std::span<const std::uint8_t>>& spans);
+
+    // Scatter read into the spans, in order. Returns the number of
+    // bytes read, which is less than the total size of the spans only
+    // at end of file.
+    std::size_t read(const std::vector<std::span<std::uint8_t>>& spans);
+
+    // Append size bytes from source, starting at offset, within the
+    // kernel where the host supports it.
+    void copy_from(const HostFile& source,
+		   std::uintmax_t offset,
+		   std::size_t size);
+
+  private:
+    std::filesystem::path m_filename;
+    int m_fd;
+    bool m_close;
+  };
+
+} // end namespace utility
+
+#endif // HOST_FILE_HH
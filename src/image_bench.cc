@@ -0,0 +1,131 @@
+// image_bench.cc
+//
+// Copyright 2025 Eric Smith
+// SPDX-License-Identifier: GPL-3.0-only
+
+// Measures images per second loaded and saved by DiskImage, for each
+// interleaved format, against a reference that reads and writes one
+// sector per stream call through the deinterleave table, as load()
+// and save() used to.
+//
+// usage: image_bench scratch-file [count]
+// The scratch file is overwritten.
+
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <magic_enum.hpp>
+
+#include "apple_ii_disk.hh"
+
+using ImageFormat = AppleII::DiskImage::ImageFormat;
+
+static void per_sector_load(const std::string& filename,
+			    ImageFormat format,
+			    std::vector<std::uint8_t>& image)
+{
+  const AppleII::DiskGeometry& geom = AppleII::DiskImage::get_geometry(format);
+  std::ifstream file(filename, std::ios_base::in | std::ios_base::binary);
+  for (std::size_t track = 0; track < geom.cylinders; ++track)
+  {
+    for (std::size_t physical_sector = 0; physical_sector < geom.sectors; ++physical_sector)
+    {
+      std::size_t logical_sector = geom.deinterleave_table[physical_sector];
+      std::size_t offset = (track * geom.sectors + logical_sector) * geom.bytes_per_sector;
+      file.read(reinterpret_cast<char*>(image.data() + offset), geom.bytes_per_sector);
+    }
+  }
+  if (file.fail())
+  {
+    throw std::runtime_error("error reading scratch file");
+  }
+}
+
+static void per_sector_save(const std::string& filename,
+			    ImageFormat format,
+			    const std::vector<std::uint8_t>& image)
+{
+  const AppleII::DiskGeometry& geom = AppleII::DiskImage::get_geometry(format);
+  std::ofstream file(filename, std::ios_base::out | std::ios_base::binary);
+  for (std::size_t track = 0; track < geom.cylinders; ++track)
+  {
+    for (std::size_t physical_sector = 0; physical_sector < geom.sectors; ++physical_sector)
+    {
+      std::size_t logical_sector = geom.deinterleave_table[physical_sector];
+      std::size_t offset = (track * geom.sectors + logical_sector) * geom.bytes_per_sector;
+      file.write(reinterpret_cast<const char*>(image.data() + offset), geom.bytes_per_sector);
+    }
+  }
+  if (file.fail())
+  {
+    throw std::runtime_error("error writing scratch file");
+  }
+}
+
+// images per second for count runs of operation
+template <typename Operation>
+static double images_per_second(std::size_t count, Operation operation)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < count; i++)
+  {
+    operation();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return count / elapsed.count();
+}
+
+int main(int argc, char* argv[])
+{
+  if ((argc < 2) || (argc > 3))
+  {
+    std::cerr << "usage: image_bench scratch-file [count]\n";
+    return 2;
+  }
+  std::string filename = argv[1];
+  std::size_t count = (argc > 2) ? std::strtoul(argv[2], nullptr, 10) : 10000;
+
+  std::cout << std::format("{} loads and saves of each format\n\n", count);
+  std::cout << "format        per-sector load  load     per-sector save  save\n"
+	    << "------------  ---------------  -------  ---------------  -------\n";
+
+  std::mt19937 generator(1);
+  for (ImageFormat format: magic_enum::enum_values<ImageFormat>())
+  {
+    if (! AppleII::DiskImage::get_geometry(format).deinterleave_table)
+    {
+      continue;
+    }
+
+    std::vector<std::uint8_t> image(AppleII::DiskImage::get_bytes_per_disk(format));
+    for (std::uint8_t& b: image)
+    {
+      b = generator();
+    }
+    std::ofstream(filename, std::ios_base::out | std::ios_base::binary)
+      .write(reinterpret_cast<const char*>(image.data()), image.size());
+    AppleII::DiskImage disk(format);
+    disk.load(filename);
+
+    double reference_load = images_per_second(count, [&]() { per_sector_load(filename, format, image); });
+    double load = images_per_second(count, [&]() { disk.load(filename); });
+    double reference_save = images_per_second(count, [&]() { per_sector_save(filename, format, image); });
+    double save = images_per_second(count, [&]() { disk.save(filename); });
+
+    std::cout << std::format("{:<12}  {:>15.0f}  {:>7.0f}  {:>15.0f}  {:>7.0f}\n",
+			     magic_enum::enum_name(format),
+			     reference_load,
+			     load,
+			     reference_save,
+			     save);
+  }
+  std::cout << "\n(images per second)\n";
+  return 0;
+}
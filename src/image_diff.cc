@@ -0,0 +1,291 @@
+// image_diff.cc
+//
+// Copyright 2025 Eric Smith
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <algorithm>
+#include <array>
+#include <format>
+#include <fstream>
+#include <iterator>
+#include <span>
+
+#include <zlib.h>
+
+#include "image_diff.hh"
+
+namespace Apex
+{
+  PatchError::PatchError(const std::string& what):
+    std::runtime_error(what)
+  {
+  }
+
+  static std::size_t image_block_count(const Disk& disk)
+  {
+    return AppleII::DiskImage::get_bytes_per_disk(disk.get_format()) / BYTES_PER_BLOCK;
+  }
+
+  // in-memory location of each block of a range, without copying
+  static std::vector<const std::uint8_t*> block_pointers(const Disk& disk,
+							 std::size_t first_block,
+							 std::size_t block_count)
+  {
+    std::vector<std::span<const std::uint8_t>> spans;
+    disk.get_sector_spans(first_block, block_count, spans);
+    std::vector<const std::uint8_t*> blocks;
+    blocks.reserve(block_count);
+    for (std::span<const std::uint8_t> span: spans)
+    {
+      for (std::size_t offset = 0; offset < span.size(); offset += BYTES_PER_BLOCK)
+      {
+	blocks.push_back(span.data() + offset);
+      }
+    }
+    return blocks;
+  }
+
+  std::vector<BlockRange> diff_blocks(const Disk& a, const Disk& b)
+  {
+    std::size_t block_count = image_block_count(a);
+    if (image_block_count(b) != block_count)
+    {
+      throw PatchError("images are of different sizes");
+    }
+    std::vector<const std::uint8_t*> a_blocks = block_pointers(a, 0, block_count);
+    std::vector<const std::uint8_t*> b_blocks = block_pointers(b, 0, block_count);
+    std::vector<BlockRange> runs;
+    for (std::size_t block = 0; block < block_count; block++)
+    {
+      if (blocks_equal(a_blocks[block], b_blocks[block]))
+      {
+	continue;
+      }
+      if ((! runs.empty()) && (runs.back().end == block))
+      {
+	++runs.back().end;
+      }
+      else
+      {
+	runs.push_back({ static_cast<std::uint16_t>(block), static_cast<std::uint16_t>(block + 1) });
+      }
+    }
+    return runs;
+  }
+
+  bool extents_equal(const Disk& a,
+		     std::uint16_t a_first_block,
+		     const Disk& b,
+		     std::uint16_t b_first_block,
+		     std::uint16_t block_count)
+  {
+    std::vector<const std::uint8_t*> a_blocks = block_pointers(a, a_first_block, block_count);
+    std::vector<const std::uint8_t*> b_blocks = block_pointers(b, b_first_block, block_count);
+    for (std::size_t i = 0; i < block_count; i++)
+    {
+      if (! blocks_equal(a_blocks[i], b_blocks[i]))
+      {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  std::uint64_t image_hash(const Disk& disk)
+  {
+    std::uint64_t h = 0;
+    for (const std::uint8_t* block: block_pointers(disk, 0, image_block_count(disk)))
+    {
+      h = (h ^ block_hash(block)) * 0x9e3779b97f4a7c15ULL;
+      h ^= h >> 32;
+    }
+    return h;
+  }
+
+
+  // patch file header, all fields little-endian
+  static constexpr std::array<std::uint8_t, 8> patch_magic { 'S', 'M', 'T', 'P', 'A', 'T', 'C', 'H' };
+  static constexpr std::uint16_t patch_version = 1;
+
+  enum PatchHeaderOffset
+  {
+    MAGIC           = 0,   // 8 bytes
+    VERSION         = 8,   // 2 bytes
+    IMAGE_BLOCKS    = 10,  // 2 bytes
+    RUN_COUNT       = 12,  // 2 bytes
+    BASE_HASH       = 16,  // 8 bytes
+    RESULT_HASH     = 24,  // 8 bytes
+    PAYLOAD_SIZE    = 32,  // 4 bytes, runs then blocks, before deflation
+    COMPRESSED_SIZE = 36,  // 4 bytes
+    HEADER_SIZE     = 40,
+  };
+
+  static void put_le(std::uint8_t* data, std::uint64_t value, std::size_t size)
+  {
+    for (std::size_t i = 0; i < size; i++)
+    {
+      data[i] = value >> (8 * i);
+    }
+  }
+
+  static std::uint64_t get_le(const std::uint8_t* data, std::size_t size)
+  {
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < size; i++)
+    {
+      value |= static_cast<std::uint64_t>(data[i]) << (8 * i);
+    }
+    return value;
+  }
+
+  ImagePatch::ImagePatch(const Disk& base, const Disk& result):
+    m_image_blocks(image_block_count(base)),
+    m_base_hash(image_hash(base)),
+    m_result_hash(image_hash(result)),
+    m_runs(diff_blocks(base, result))
+  {
+    for (const BlockRange& run: m_runs)
+    {
+      for (const std::uint8_t* block: block_pointers(result, run.begin, run.end - run.begin))
+      {
+	m_data.insert(m_data.end(), block, block + BYTES_PER_BLOCK);
+      }
+    }
+  }
+
+  ImagePatch::ImagePatch(const std::filesystem::path& filename)
+  {
+    std::ifstream file(filename, std::ios_base::in | std::ios_base::binary);
+    if (! file.is_open())
+    {
+      throw PatchError(std::format("unable to open patch \"{}\" to read", filename.string()));
+    }
+    std::vector<std::uint8_t> contents((std::istreambuf_iterator<char>(file)),
+				       std::istreambuf_iterator<char>());
+    if ((contents.size() < HEADER_SIZE) ||
+	(! std::equal(patch_magic.begin(), patch_magic.end(), contents.begin() + MAGIC)))
+    {
+      throw PatchError(std::format("\"{}\" isn't a summit patch", filename.string()));
+    }
+    if (get_le(contents.data() + VERSION, 2) != patch_version)
+    {
+      throw PatchError(std::format("patch \"{}\" has unsupported version", filename.string()));
+    }
+    m_image_blocks = get_le(contents.data() + IMAGE_BLOCKS, 2);
+    std::size_t run_count = get_le(contents.data() + RUN_COUNT, 2);
+    m_base_hash = get_le(contents.data() + BASE_HASH, 8);
+    m_result_hash = get_le(contents.data() + RESULT_HASH, 8);
+    uLongf payload_size = get_le(contents.data() + PAYLOAD_SIZE, 4);
+    std::size_t compressed_size = get_le(contents.data() + COMPRESSED_SIZE, 4);
+    // checked before anything is allocated from the header's sizes
+    if ((contents.size() != HEADER_SIZE + compressed_size) ||
+	(run_count > m_image_blocks) ||
+	(payload_size < run_count * 4) ||
+	(payload_size > run_count * 4 + m_image_blocks * BYTES_PER_BLOCK))
+    {
+      throw PatchError(std::format("patch \"{}\" is corrupt", filename.string()));
+    }
+
+    std::vector<std::uint8_t> payload(payload_size);
+    uLongf inflated_size = payload_size;
+    if ((uncompress(payload.data(), &inflated_size, contents.data() + HEADER_SIZE, compressed_size) != Z_OK) ||
+	(inflated_size != payload_size))
+    {
+      throw PatchError(std::format("patch \"{}\" is corrupt", filename.string()));
+    }
+
+    std::size_t data_size = 0;
+    for (std::size_t i = 0; i < run_count; i++)
+    {
+      BlockRange run
+      {
+	static_cast<std::uint16_t>(get_le(payload.data() + 4 * i, 2)),
+	static_cast<std::uint16_t>(get_le(payload.data() + 4 * i + 2, 2)),
+      };
+      if ((run.begin >= run.end) || (run.end > m_image_blocks))
+      {
+	throw PatchError(std::format("patch \"{}\" is corrupt", filename.string()));
+      }
+      m_runs.push_back(run);
+      data_size += (run.end - run.begin) * BYTES_PER_BLOCK;
+    }
+    if (payload_size != run_count * 4 + data_size)
+    {
+      throw PatchError(std::format("patch \"{}\" is corrupt", filename.string()));
+    }
+    m_data.assign(payload.begin() + run_count * 4, payload.end());
+  }
+
+  void ImagePatch::save(const std::filesystem::path& filename) const
+  {
+    std::vector<std::uint8_t> payload(m_runs.size() * 4);
+    for (std::size_t i = 0; i < m_runs.size(); i++)
+    {
+      put_le(payload.data() + 4 * i, m_runs[i].begin, 2);
+      put_le(payload.data() + 4 * i + 2, m_runs[i].end, 2);
+    }
+    payload.insert(payload.end(), m_data.begin(), m_data.end());
+
+    std::vector<std::uint8_t> contents(HEADER_SIZE + compressBound(payload.size()));
+    uLongf compressed_size = contents.size() - HEADER_SIZE;
+    if (compress2(contents.data() + HEADER_SIZE, &compressed_size,
+		  payload.data(), payload.size(),
+		  Z_BEST_COMPRESSION) != Z_OK)
+    {
+      throw PatchError("unable to compress patch");
+    }
+    contents.resize(HEADER_SIZE + compressed_size);
+
+    std::copy(patch_magic.begin(), patch_magic.end(), contents.begin() + MAGIC);
+    put_le(contents.data() + VERSION, patch_version, 2);
+    put_le(contents.data() + IMAGE_BLOCKS, m_image_blocks, 2);
+    put_le(contents.data() + RUN_COUNT, m_runs.size(), 2);
+    put_le(contents.data() + BASE_HASH, m_base_hash, 8);
+    put_le(contents.data() + RESULT_HASH, m_result_hash, 8);
+    put_le(contents.data() + PAYLOAD_SIZE, payload.size(), 4);
+    put_le(contents.data() + COMPRESSED_SIZE, compressed_size, 4);
+
+    std::ofstream file(filename, std::ios_base::out | std::ios_base::binary);
+    if (! file.is_open())
+    {
+      throw PatchError(std::format("unable to open patch \"{}\" to write", filename.string()));
+    }
+    file.write(reinterpret_cast<const char*>(contents.data()), contents.size());
+    file.close();
+    if (file.fail())
+    {
+      throw PatchError(std::format("error writing patch \"{}\"", filename.string()));
+    }
+  }
+
+  void ImagePatch::apply(Disk& disk) const
+  {
+    if (image_block_count(disk) != m_image_blocks)
+    {
+      throw PatchError("patch is for an image of a different size");
+    }
+    std::uint64_t hash = image_hash(disk);
+    if (hash != m_base_hash)
+    {
+      throw PatchError((hash == m_result_hash) ?
+		       "patch has already been applied to image" :
+		       "image isn't the one the patch was made from");
+    }
+    const std::uint8_t* data = m_data.data();
+    for (const BlockRange& run: m_runs)
+    {
+      disk.write(run.begin, run.end - run.begin, data);
+      data += (run.end - run.begin) * BYTES_PER_BLOCK;
+    }
+    if (image_hash(disk) != m_result_hash)
+    {
+      throw PatchError("patched image doesn't match the patch");
+    }
+  }
+
+  const std::vector<BlockRange>& ImagePatch::get_runs() const
+  {
+    return m_runs;
+  }
+
+} // end namespace Apex
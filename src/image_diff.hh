@@ -0,0 +1,66 @@
+// image_diff.hh
+//
+// Copyright 2025 Eric Smith
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef IMAGE_DIFF_HH
+#define IMAGE_DIFF_HH
+
+#include <cstdint>
+#include <filesystem>
+#include <stdexcept>
+#include <vector>
+
+#include "apex_disk.hh"
+
+namespace Apex
+{
+  struct PatchError: public std::runtime_error
+  { PatchError(const std::string& what); };
+
+  // Blocks that differ between two images of the same format, as runs
+  // of consecutive blocks in ascending order.
+  std::vector<BlockRange> diff_blocks(const Disk& a, const Disk& b);
+
+  // Whether a range of blocks of one image is identical to a range of
+  // the same length in another.
+  bool extents_equal(const Disk& a,
+		     std::uint16_t a_first_block,
+		     const Disk& b,
+		     std::uint16_t b_first_block,
+		     std::uint16_t block_count);
+
+  // Hash of the whole logical image, combining the hashes of its
+  // blocks.
+  std::uint64_t image_hash(const Disk& disk);
+
+  // The blocks of one image (the result) that differ from another
+  // (the base), which turn the base into the result. The hashes of
+  // both images are kept, so that a patch is only applied to its base,
+  // and the result can be checked. The file form is a short header
+  // followed by the runs and their blocks, deflated.
+  class ImagePatch
+  {
+  public:
+    ImagePatch(const Disk& base, const Disk& result);
+    ImagePatch(const std::filesystem::path& filename);
+
+    void save(const std::filesystem::path& filename) const;
+
+    // Throws if disk isn't the base image, or the patched image
+    // doesn't match the result.
+    void apply(Disk& disk) const;
+
+    const std::vector<BlockRange>& get_runs() const;
+
+  private:
+    std::size_t m_image_blocks;
+    std::uint64_t m_base_hash;
+    std::uint64_t m_result_hash;
+    std::vector<BlockRange> m_runs;
+    std::vector<std::uint8_t> m_data;  // blocks of the runs, in order
+  };
+
+} // end namespace Apex
+
+#endif // IMAGE_DIFF_HH
@@ -0,0 +1,281 @@
+// output_sink.cc
+//
+// Copyright 2025 Eric Smith
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <ostream>
+
+#include "output_sink.hh"
+
+namespace utility
+{
+  OutputSink::OutputSink(OutputFormat format,
+			 std::ostream* out,
+			 std::size_t capacity):
+    m_format(format),
+    m_out(out),
+    m_capacity(capacity)
+  {
+    if (m_out)
+    {
+      m_buffer.reserve(m_capacity);
+    }
+  }
+
+  OutputSink::~OutputSink()
+  {
+    try
+    {
+      flush();
+    }
+    catch (...)
+    {
+    }
+  }
+
+  OutputFormat OutputSink::get_format() const
+  {
+    return m_format;
+  }
+
+  void OutputSink::set_context(std::string_view name, std::string value)
+  {
+    for (auto& [context_name, context_value]: m_context)
+    {
+      if (context_name == name)
+      {
+	context_value = std::move(value);
+	return;
+      }
+    }
+    m_context.emplace_back(name, std::move(value));
+  }
+
+  void OutputSink::record(std::initializer_list<OutputField> fields)
+  {
+    auto append_number = [&](std::uint64_t number)
+    {
+      std::format_to(std::back_inserter(m_buffer), "{}", number);
+    };
+
+    switch (m_format)
+    {
+    case OutputFormat::TABLE:
+      for (const OutputField& field: fields)
+      {
+	if (&field != fields.begin())
+	{
+	  m_buffer += "  ";
+	}
+	if (auto number = std::get_if<std::uint64_t>(&field.value))
+	{
+	  std::format_to(std::back_inserter(m_buffer), "{:>{}}", *number, field.width);
+	}
+	else
+	{
+	  std::format_to(std::back_inserter(m_buffer), "{:<{}}", std::get<std::string_view>(field.value), field.width);
+	}
+      }
+      m_buffer += '\n';
+      break;
+
+    case OutputFormat::CSV:
+      m_csv_scratch.clear();
+      for (const auto& [name, value]: m_context)
+      {
+	m_csv_scratch += name;
+	m_csv_scratch += ',';
+      }
+      for (const OutputField& field: fields)
+      {
+	m_csv_scratch += field.name;
+	m_csv_scratch += ',';
+      }
+      m_csv_scratch.pop_back();
+      start_csv_records(m_csv_scratch);
+      for (const auto& [name, value]: m_context)
+      {
+	append_csv_value(value);
+	m_buffer += ',';
+      }
+      for (const OutputField& field: fields)
+      {
+	if (auto number = std::get_if<std::uint64_t>(&field.value))
+	{
+	  append_number(*number);
+	}
+	else
+	{
+	  append_csv_value(std::get<std::string_view>(field.value));
+	}
+	m_buffer += ',';
+      }
+      m_buffer.back() = '\n';
+      break;
+
+    case OutputFormat::JSONL:
+      m_buffer += '{';
+      for (const auto& [name, value]: m_context)
+      {
+	append_json_string(name);
+	m_buffer += ':';
+	append_json_string(value);
+	m_buffer += ',';
+      }
+      for (const OutputField& field: fields)
+      {
+	append_json_string(field.name);
+	m_buffer += ':';
+	if (auto number = std::get_if<std::uint64_t>(&field.value))
+	{
+	  append_number(*number);
+	}
+	else
+	{
+	  append_json_string(std::get<std::string_view>(field.value));
+	}
+	m_buffer += ',';
+      }
+      if (m_buffer.back() == ',')
+      {
+	m_buffer.pop_back();
+      }
+      m_buffer += "}\n";
+      break;
+
+    case OutputFormat::NUL:
+      for (const auto& [name, value]: m_context)
+      {
+	m_buffer += value;
+	m_buffer += '\t';
+      }
+      for (const OutputField& field: fields)
+      {
+	if (auto number = std::get_if<std::uint64_t>(&field.value))
+	{
+	  append_number(*number);
+	}
+	else
+	{
+	  m_buffer += std::get<std::string_view>(field.value);
+	}
+	m_buffer += '\t';
+      }
+      m_buffer.back() = '\0';
+      break;
+    }
+    flush_if_full();
+  }
+
+  void OutputSink::append(OutputSink& other)
+  {
+    if (! other.m_csv_leading_header.empty())
+    {
+      start_csv_records(other.m_csv_leading_header);
+    }
+    if (! other.m_csv_header.empty())
+    {
+      m_csv_header = other.m_csv_header;
+    }
+    other.m_csv_header.clear();
+    other.m_csv_leading_header.clear();
+    m_buffer += other.m_buffer;
+    other.m_buffer.clear();
+    flush_if_full();
+  }
+
+  void OutputSink::flush()
+  {
+    if (! m_out)
+    {
+      return;
+    }
+    if (! m_buffer.empty())
+    {
+      m_out->write(m_buffer.data(), m_buffer.size());
+      m_buffer.clear();
+    }
+    m_out->flush();
+  }
+
+  void OutputSink::flush_if_full()
+  {
+    if (m_out && (m_buffer.size() >= m_capacity))
+    {
+      m_out->write(m_buffer.data(), m_buffer.size());
+      m_buffer.clear();
+    }
+  }
+
+  // Write a header line if the records that follow have different
+  // fields from those before them.
+  void OutputSink::start_csv_records(const std::string& header)
+  {
+    if (header == m_csv_header)
+    {
+      return;
+    }
+    if ((! m_out) && m_buffer.empty() && m_csv_leading_header.empty())
+    {
+      m_csv_leading_header = header;
+    }
+    else
+    {
+      m_buffer += header;
+      m_buffer += '\n';
+    }
+    m_csv_header = header;
+  }
+
+  // RFC 4180: quote values containing a delimiter, quote, or line
+  // break, doubling any quotes
+  void OutputSink::append_csv_value(std::string_view value)
+  {
+    if (value.find_first_of(",\"\r\n") == std::string_view::npos)
+    {
+      m_buffer += value;
+      return;
+    }
+    m_buffer += '"';
+    for (char c: value)
+    {
+      if (c == '"')
+      {
+	m_buffer += '"';
+      }
+      m_buffer += c;
+    }
+    m_buffer += '"';
+  }
+
+  void OutputSink::append_json_string(std::string_view value)
+  {
+    m_buffer += '"';
+    for (char c: value)
+    {
+      switch (c)
+      {
+      case '"':  m_buffer += "\\\""; break;
+      case '\\': m_buffer += "\\\\"; break;
+      case '\n': m_buffer += "\\n";  break;
+      case '\r': m_buffer += "\\r";  break;
+      case '\t': m_buffer += "\\t";  break;
+      default:
+	// Bytes with the high bit set, as in Apex names, are escaped
+	// as the Latin-1 characters they would be, since the raw bytes
+	// may not be valid UTF-8.
+	if ((static_cast<unsigned char>(c) < 0x20) || (static_cast<unsigned char>(c) >= 0x80))
+	{
+	  std::format_to(std::back_inserter(m_buffer), "\\u{:04x}", static_cast<unsigned char>(c));
+	}
+	else
+	{
+	  m_buffer += c;
+	}
+	break;
+      }
+    }
+    m_buffer += '"';
+  }
+
+} // end namespace utility
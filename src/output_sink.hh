@@ -0,0 +1,101 @@
+// output_sink.hh
+//
+// Copyright 2025 Eric Smith
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef OUTPUT_SINK_HH
+#define OUTPUT_SINK_HH
+
+#include <cstdint>
+#include <format>
+#include <initializer_list>
+#include <iosfwd>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace utility
+{
+  enum class OutputFormat
+  {
+    TABLE,  // human-readable text, with records as fixed-width columns
+    CSV,    // records only, comma-separated with a header line
+    JSONL,  // records only, one JSON object per line
+    NUL,    // records only, tab-separated fields, each record ending in NUL
+  };
+
+  struct OutputField
+  {
+    std::string_view name;
+    std::variant<std::string_view, std::uint64_t> value;
+    unsigned width = 0;  // column width for TABLE format; numbers are right-aligned
+  };
+
+  // Command output, accumulated in a large buffer that is written out
+  // in big writes. Free-form text appears only in TABLE format, while
+  // records appear in every format, so the structured formats contain
+  // nothing but records.
+  class OutputSink
+  {
+  public:
+    static constexpr std::size_t DEFAULT_CAPACITY = 1 << 20;
+
+    // If out is null, output accumulates until taken by append().
+    OutputSink(OutputFormat format,
+	       std::ostream* out = nullptr,
+	       std::size_t capacity = DEFAULT_CAPACITY);
+    ~OutputSink();
+
+    OutputSink(const OutputSink&) = delete;
+    OutputSink& operator=(const OutputSink&) = delete;
+
+    OutputFormat get_format() const;
+
+    // field added at the start of each record in the structured
+    // formats, such as the image that the records describe
+    void set_context(std::string_view name, std::string value);
+
+    template <typename... Args>
+    void print(std::format_string<Args...> fmt, Args&&... args)
+    {
+      if (m_format != OutputFormat::TABLE)
+      {
+	return;
+      }
+      std::format_to(std::back_inserter(m_buffer), fmt, std::forward<Args>(args)...);
+      flush_if_full();
+    }
+
+    void record(std::initializer_list<OutputField> fields);
+
+    // Move the output accumulated by another sink to this one. In CSV
+    // format a header line is written before the first record, and
+    // again whenever the field names change, as when a session runs
+    // several commands; a sink without a stream leaves its leading
+    // header to the sink it is appended to.
+    void append(OutputSink& other);
+
+    void flush();
+
+  private:
+    void flush_if_full();
+    void start_csv_records(const std::string& header);
+    void append_csv_value(std::string_view value);
+    void append_json_string(std::string_view value);
+
+    OutputFormat m_format;
+    std::ostream* m_out;
+    std::size_t m_capacity;
+    std::string m_buffer;
+    std::vector<std::pair<std::string, std::string>> m_context;
+    std::string m_csv_header;          // header of the latest record
+    std::string m_csv_leading_header;  // header not yet written, of the first record
+    std::string m_csv_scratch;
+  };
+
+} // end namespace utility
+
+#endif // OUTPUT_SINK_HH
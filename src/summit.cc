@@ -3,13 +3,24 @@
 // Copyright 2022-2025 Eric Smith
 // SPDX-License-Identifier: GPL-3.0-only
 
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <deque>
+#include <exception>
 #include <filesystem>
 #include <format>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <utility>
 
 #include <boost/program_options.hpp>
 
@@ -18,7 +29,12 @@
 #include "apex_disk.hh"
 #include "app_metadata.hh"
 #include "apple_ii_disk.hh"
+#include "host_file.hh"
+#include "image_diff.hh"
+#include "output_sink.hh"
+#include "tar_archive.hh"
 #include "utility.hh"
+#include "worker_pool.hh"
 
 
 namespace po = boost::program_options;
@@ -55,176 +71,517 @@ enum class Command
   RM,
   CREATE,
   INSERT,
+  SESSION,
+  EXPORT,
+  IMPORT,
+  CP,
+  DIFF,
+  PATCH,
+  SYNC,
   // for debug:
   FREE,
 };
 
 
-bool patterns_match(const std::vector<Apex::Filename>& patterns,
-		    const Apex::Filename& filename)
+// Conversion of file contents by extract and insert; see
+// Apex::text_to_host() and Apex::text_from_host().
+enum class Conversion
 {
+  BINARY,         // none
+  TEXT,
+  TEXT_HIGH_BIT,  // text, and insert sets the high bit of each character
+};
+
+
+// Settings shared by all images a command is run on.
+struct CommandOptions
+{
+  AppleII::DiskImage::ImageFormat disk_image_format;
+  std::vector<Apex::Filename> patterns;
+  AppleII::DiskImage::SaveMode save_mode;
+  Apex::AllocationPolicy allocation_policy;
+  bool replace_existing;
+  Conversion conversion;
+  utility::OutputFormat output_format;
+  std::string archive_fn;  // tar archive, empty or "-" for standard I/O
+};
+
+
+// For commands that act on all files when no patterns are given. The
+// pattern functions below match nothing for an empty list, so that a
+// missing pattern can't select every file by accident.
+std::vector<Apex::Filename> all_files_if_empty(const std::vector<Apex::Filename>& patterns)
+{
+  if (patterns.empty())
+  {
+    return { Apex::Filename("*.*") };
+  }
+  return patterns;
+}
+
+
+// Compile filename patterns for Directory::match().
+std::vector<Apex::Pattern> compile_patterns(const std::vector<Apex::Filename>& patterns)
+{
+  return std::vector<Apex::Pattern>(patterns.begin(), patterns.end());
+}
+
+
+// Select the valid entries matching at least one of the patterns, as
+// a mask of entry indices. Patterns without wildcards are looked up
+// directly in the directory's name index.
+std::uint64_t select_entries(Apex::Directory& dir,
+			     const std::vector<Apex::Filename>& patterns)
+{
+  std::uint64_t selected = 0;
+  std::vector<Apex::Filename> wildcard_patterns;
   for (const Apex::Filename& pattern: patterns)
   {
-    if (pattern.match(filename))
+    if (pattern.has_wildcard())
     {
-      return true;
+      wildcard_patterns.push_back(pattern);
     }
+    else if (Apex::DirectoryEntry* entry = dir.find(pattern))
+    {
+      selected |= std::uint64_t(1) << entry->get_index();
+    }
+  }
+  if (! wildcard_patterns.empty())
+  {
+    selected |= dir.match(compile_patterns(wildcard_patterns));
   }
-  return false;
+  return selected;
 }
 
 
-void ls(AppleII::DiskImage::ImageFormat disk_image_format,
-	const std::string& disk_image_fn,
-	const std::vector<Apex::Filename>& patterns)
+// The commands are split into a part that loads (and for modifying
+// commands, saves) the image, and a part that works on an image
+// already in memory, which is shared with session mode.
+
+void list_files(Apex::Directory& dir,
+		const std::vector<Apex::Filename>& patterns,
+		utility::OutputSink& out)
 {
-  const std::vector<Apex::Filename> wildcard
+  unsigned file_listed_count = 0;
+  out.print("volume {}, date {}, title \"{}\"\n",
+	    dir.get_volume_number(),
+	    dir.get_date().to_string(),
+	    dir.get_title());
+  out.print("\n"
+	    "              first   block\n"
+	    "filename      block   count   date\n"
+	    "------------  ------  ------  ----------\n");
+  for (const auto& dir_entry: dir.entries(select_entries(dir, all_files_if_empty(patterns))))
   {
-    Apex::Filename("*.*"),
-  };
+    ++file_listed_count;
+    std::string filename = dir_entry.get_filename().to_string();
+    std::string date = dir_entry.get_date().to_string();
+    out.record({ { "filename",    filename,                      12 },
+		 { "first_block", dir_entry.get_first_block(),  6 },
+		 { "block_count", dir_entry.get_block_count(),  6 },
+		 { "date",        date } });
+  }
+  out.print("\n"
+	    "{} of {} files listed, {} blocks used, {} blocks free of {} total blcoks\n"
+	    "\n",
+	    file_listed_count,
+	    dir.valid_count(),
+	    dir.volume_size_blocks() - dir.volume_free_blocks(),
+	    dir.volume_free_blocks(),
+	    dir.volume_size_blocks());
+}
 
-  const std::vector<Apex::Filename>& p = patterns.size() ? patterns : wildcard;
 
+void ls(AppleII::DiskImage::ImageFormat disk_image_format,
+	const std::string& disk_image_fn,
+	const std::vector<Apex::Filename>& patterns,
+	utility::OutputSink& out)
+{
   Apex::Disk disk(disk_image_format);
-  disk.load(disk_image_fn);
+  disk.load(disk_image_fn, AppleII::DiskImage::Backing::MAPPED);
   auto dir = disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
-  unsigned file_count = 0;
-  unsigned file_listed_count = 0;
-  std::cout << std::format("volume {}, date {}, title \"{}\"\n",
-			   dir.get_volume_number(),
-			   dir.get_date().to_string(),
-			   dir.get_title());
-  std::cout << '\n';
-  std::cout << "              first   block\n";
-  std::cout << "filename      block   count   date\n";
-  std::cout << "------------  ------  ------  ----------\n";
-  for (const auto& dir_entry: dir)
-  {
-    if (dir_entry.get_status() == Apex::DirectoryEntry::Status::VALID)
-    {
-      ++file_count;
-      const Apex::Filename& filename = dir_entry.get_filename();
-      if (patterns_match(p, filename))
-      {
-	++file_listed_count;
-	std::cout << std::format("{:12}  {:6d}  {:6d}  {}\n",
-				 filename.to_string(),
-				 dir_entry.get_first_block(),
-				 dir_entry.get_block_count(),
-				 dir_entry.get_date().to_string());
-      }
-    }
-  }
-  std::cout << '\n';
-  std::cout << std::format("{} of {} files listed, {} blocks used, {} blocks free of {} total blcoks\n",
-			   file_listed_count,
-			   file_count,
-			   dir.volume_size_blocks() - dir.volume_free_blocks(),
-			   dir.volume_free_blocks(),
-			   dir.volume_size_blocks());
-  std::cout << "\n";
+  list_files(dir, patterns, out);
 };
 
 
+// The structured formats get one record per free extent.
+void list_free_blocks(const Apex::Directory& dir,
+		      utility::OutputSink& out,
+		      std::ostream& err)
+{
+  if (! dir.check_consistency())
+  {
+    err << "directory inconsistent - file block ranges incorrect or overlap\n";
+  }
+  if (out.get_format() == utility::OutputFormat::TABLE)
+  {
+    std::ostringstream listing;
+    dir.debug_list_free_blocks(listing);
+    out.print("{}", listing.view());
+    return;
+  }
+  for (const Apex::BlockRange& extent: dir.get_free_extents())
+  {
+    out.record({ { "first_block", extent.begin },
+		 { "last_block",  std::uint16_t(extent.end - 1) },
+		 { "block_count", std::uint16_t(extent.end - extent.begin) } });
+  }
+}
+
+
 void free(AppleII::DiskImage::ImageFormat disk_image_format,
-	  const std::string& disk_image_fn)
+	  const std::string& disk_image_fn,
+	  utility::OutputSink& out,
+	  std::ostream& err)
 {
   Apex::Disk disk(disk_image_format);
-  disk.load(disk_image_fn);
+  disk.load(disk_image_fn, AppleII::DiskImage::Backing::MAPPED);
   auto dir = disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
-  dir.debug_list_free_blocks();
+  list_free_blocks(dir, out, err);
 };
 
 
+std::size_t delete_files(Apex::Directory& dir,
+			 const std::vector<Apex::Filename>& patterns,
+			 utility::OutputSink& out)
+{
+  if (patterns.empty())
+  {
+    throw std::invalid_argument("no files given to delete");
+  }
+  std::size_t file_deleted_count = 0;
+  for (auto& dir_entry: dir.entries(select_entries(dir, patterns)))
+  {
+    std::string filename = dir_entry.get_filename().to_string();
+    out.print("deleting file {}\n", filename);
+    if (out.get_format() != utility::OutputFormat::TABLE)
+    {
+      out.record({ { "deleted", filename } });
+    }
+    dir_entry.delete_file();
+    ++file_deleted_count;
+  }
+  return file_deleted_count;
+}
+
+
 void rm(AppleII::DiskImage::ImageFormat disk_image_format,
 	const std::string& disk_image_fn,
-	const std::vector<Apex::Filename>& patterns)
+	const std::vector<Apex::Filename>& patterns,
+	AppleII::DiskImage::SaveMode save_mode,
+	utility::OutputSink& out)
 {
   Apex::Disk disk(disk_image_format);
   disk.load(disk_image_fn);
   auto dir = disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
-  unsigned file_deleted_count = 0;
-  for (auto& dir_entry: dir)
+  Apex::Directory::Transaction transaction(dir);
+  std::size_t file_deleted_count = delete_files(dir, patterns, out);
+  transaction.commit();
+  disk.save(disk_image_fn, save_mode);
+  out.print("{} files deleted\n", file_deleted_count);
+}
+
+
+// image_file must be open if any of the file's blocks can be copied
+// directly from it; see DiskImage::get_clean_file_offset(). Only
+// reads the disk, so several files may be extracted concurrently.
+void extract_file(const Apex::Disk& disk,
+		  const utility::HostFile* image_file,
+		  const Apex::Filename& filename,
+		  std::uint16_t first_block,
+		  std::uint16_t block_count,
+		  Conversion conversion,
+		  const std::filesystem::path& output_dir)
+{
+  std::filesystem::path host_filename = output_dir / utility::downcase_string(filename.to_string());
+  utility::HostFile host_file(host_filename, utility::HostFile::Mode::WRITE);
+
+  if (conversion != Conversion::BINARY)
   {
-    if (dir_entry.get_status() == Apex::DirectoryEntry::Status::VALID)
+    std::vector<std::span<const std::uint8_t>> spans;
+    disk.get_sector_spans(first_block, block_count, spans);
+    std::vector<std::uint8_t> host_text;
+    host_text.reserve(block_count * Apex::BYTES_PER_BLOCK);
+    for (std::span<const std::uint8_t> span: spans)
     {
-      const Apex::Filename& filename = dir_entry.get_filename();
-      if (patterns_match(patterns, filename))
+      if (Apex::text_to_host(span, host_text))
       {
-	std::cout << std::format("deleting file {}\n", filename.to_string());
-	dir_entry.delete_file();
-	++file_deleted_count;
+	break;
       }
     }
+    host_file.write({ std::span<const std::uint8_t>(host_text) });
+    return;
+  }
+
+  // Apex files are contiguous, so the whole file is moved at once,
+  // directly from the image file if it is stored contiguously there
+  // and unmodified, otherwise from the image in memory.
+  if (auto image_offset = disk.get_clean_file_offset(first_block, block_count))
+  {
+    host_file.copy_from(*image_file, *image_offset, block_count * Apex::BYTES_PER_BLOCK);
+  }
+  else
+  {
+    std::vector<std::span<const std::uint8_t>> spans;
+    disk.get_sector_spans(first_block, block_count, spans);
+    host_file.write(spans);
   }
-  disk.save(disk_image_fn);
-  std::cout << std::format("{} files deleted\n", file_deleted_count);
 }
 
 
-void extract_file(Apex::Disk& disk,
-		  const Apex::Filename& filename,
-		  std::uint16_t first_block,
-		  std::uint16_t block_count)
+// If pool isn't null, the host files are created and written by its
+// workers, which share the disk read-only. Progress is reported in
+// directory order regardless. If any file fails, the first error is
+// thrown once all of the files have been attempted.
+std::size_t extract_files(const Apex::Disk& disk,
+			  Apex::Directory& dir,
+			  const std::vector<Apex::Filename>& patterns,
+			  Conversion conversion,
+			  const std::filesystem::path& output_dir,
+			  utility::WorkerPool* pool,
+			  utility::OutputSink& out)
 {
-  std::string host_filename = utility::downcase_string(filename.to_string());
-  std::cout << std::format("extracting file {}, first block {}, block count {}\n",
-			   filename.to_string(),
-			   first_block,
-			   block_count);
-  std::ofstream host_file(host_filename,
-			  std::ios_base::out | std::ios_base::binary);
-  if (! host_file.is_open())
+  if (! output_dir.empty())
   {
-    throw std::runtime_error(std::format("unable to open host file \"{}\" to write", host_filename));
+    std::filesystem::create_directories(output_dir);
   }
-  std::array<std::uint8_t, Apex::BYTES_PER_BLOCK> buffer;
-  for (std::uint16_t block_number = first_block;
-       block_number < (first_block + block_count);
-       ++block_number)
+
+  std::optional<utility::HostFile> image_file;
+  std::vector<std::future<void>> pending;
+  std::size_t file_count = 0;
+  std::exception_ptr first_error;
+  try
   {
-    disk.read(block_number, 1, buffer.data());
-    host_file.write(reinterpret_cast<const char*>(buffer.data()), Apex::BYTES_PER_BLOCK);
-    if (host_file.fail())
+    for (const auto& dir_entry: dir.entries(select_entries(dir, all_files_if_empty(patterns))))
     {
-      throw std::runtime_error(std::format("error writing host file \"{}\"", host_filename));
+      Apex::Filename filename = dir_entry.get_filename();
+      std::uint16_t first_block = dir_entry.get_first_block();
+      std::uint16_t block_count = dir_entry.get_block_count();
+      out.print("extracting file {}, first block {}, block count {}\n",
+		filename.to_string(),
+		first_block,
+		block_count);
+      if (out.get_format() != utility::OutputFormat::TABLE)
+      {
+	std::string filename_string = filename.to_string();
+	out.record({ { "extracted",   filename_string },
+		     { "first_block", first_block },
+		     { "block_count", block_count } });
+      }
+      if ((! image_file.has_value()) &&
+	  (conversion == Conversion::BINARY) &&
+	  disk.get_clean_file_offset(first_block, block_count))
+      {
+	image_file.emplace(disk.get_filename(), utility::HostFile::Mode::READ);
+      }
+      const utility::HostFile* image_file_ptr = image_file ? &*image_file : nullptr;
+      if (pool)
+      {
+	pending.push_back(pool->submit([&disk, image_file_ptr, filename, first_block, block_count, conversion, &output_dir]()
+	{
+	  extract_file(disk, image_file_ptr, filename, first_block, block_count, conversion, output_dir);
+	}));
+      }
+      else
+      {
+	extract_file(disk, image_file_ptr, filename, first_block, block_count, conversion, output_dir);
+      }
+      ++file_count;
     }
   }
+  catch (...)
+  {
+    first_error = std::current_exception();
+  }
+
+  // The tasks refer to the disk, the image file and the output
+  // directory, so all of them are waited for even after an error.
+  for (std::future<void>& result: pending)
+  {
+    try
+    {
+      result.get();
+    }
+    catch (...)
+    {
+      if (! first_error)
+      {
+	first_error = std::current_exception();
+      }
+    }
+  }
+  if (first_error)
+  {
+    std::rethrow_exception(first_error);
+  }
+  return file_count;
 }
 
 
 void extract(AppleII::DiskImage::ImageFormat disk_image_format,
 	     const std::string& disk_image_fn,
-	     const std::vector<Apex::Filename>& patterns)
+	     const std::vector<Apex::Filename>& patterns,
+	     Conversion conversion,
+	     const std::filesystem::path& output_dir,
+	     utility::WorkerPool* pool,
+	     utility::OutputSink& out)
+{
+  Apex::Disk disk(disk_image_format);
+  disk.load(disk_image_fn, AppleII::DiskImage::Backing::MAPPED);
+  auto dir = disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
+  std::size_t file_count = extract_files(disk, dir, patterns, conversion, output_dir, pool, out);
+  out.print("{} files extracted\n", file_count);
+}
+
+
+// Apex dates have no time of day, so files are stamped at midnight
+// UTC. An invalid date maps to the epoch.
+static std::int64_t apex_date_to_unix_time(const Apex::Date& date)
 {
-  const std::vector<Apex::Filename> wildcard
+  std::chrono::year_month_day ymd(std::chrono::year(date.get_year()),
+				  std::chrono::month(date.get_month()),
+				  std::chrono::day(date.get_day()));
+  if (! ymd.ok())
   {
-    Apex::Filename("*.*"),
-  };
+    return 0;
+  }
+  std::chrono::sys_seconds time = std::chrono::sys_days(ymd);
+  return time.time_since_epoch().count();
+}
 
-  const std::vector<Apex::Filename>& p = patterns.size() ? patterns : wildcard;
 
-  Apex::Disk disk(disk_image_format);
-  disk.load(disk_image_fn);
-  auto dir = disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
+// A time outside the range of Apex dates maps to today.
+static Apex::Date unix_time_to_apex_date(std::int64_t unix_time)
+{
+  std::chrono::sys_seconds time{std::chrono::seconds(unix_time)};
+  std::chrono::year_month_day ymd = std::chrono::floor<std::chrono::days>(time);
+  int year = static_cast<int>(ymd.year());
+  if ((year < Apex::Date::EPOCH_YEAR) || (year > Apex::Date::EPOCH_YEAR + 127))
+  {
+    return Apex::Date();
+  }
+  return Apex::Date(year, static_cast<unsigned>(ymd.month()), static_cast<unsigned>(ymd.day()));
+}
+
 
+// Write the selected files to a tar archive, each taken directly from
+// its extent in the image, or from the image file where the extent is
+// stored there contiguously and unmodified, so no host files are
+// created. Members are named as extract would name the host files.
+std::size_t export_files(const Apex::Disk& disk,
+			 Apex::Directory& dir,
+			 const std::vector<Apex::Filename>& patterns,
+			 Conversion conversion,
+			 utility::TarWriter& tar,
+			 utility::OutputSink& out)
+{
+  std::optional<utility::HostFile> image_file;
+  std::vector<std::span<const std::uint8_t>> spans;
+  std::vector<std::uint8_t> host_text;
   std::size_t file_count = 0;
-  for (const auto& dir_entry: dir)
+  for (const auto& dir_entry: dir.entries(select_entries(dir, all_files_if_empty(patterns))))
   {
-    if (dir_entry.get_status() == Apex::DirectoryEntry::Status::VALID)
+    std::string filename = dir_entry.get_filename().to_string();
+    std::uint16_t first_block = dir_entry.get_first_block();
+    std::uint16_t block_count = dir_entry.get_block_count();
+    out.print("exporting file {}, first block {}, block count {}\n",
+	      filename,
+	      first_block,
+	      block_count);
+    if (out.get_format() != utility::OutputFormat::TABLE)
+    {
+      out.record({ { "exported",    filename },
+		   { "first_block", first_block },
+		   { "block_count", block_count } });
+    }
+
+    utility::TarMember member
     {
-      const Apex::Filename& filename = dir_entry.get_filename();
-      if (patterns_match(p, filename))
+      .name  = utility::downcase_string(filename),
+      .size  = std::uintmax_t(block_count) * Apex::BYTES_PER_BLOCK,
+      .mtime = apex_date_to_unix_time(dir_entry.get_date()),
+    };
+    spans.clear();
+    disk.get_sector_spans(first_block, block_count, spans);
+    if (conversion != Conversion::BINARY)
+    {
+      host_text.clear();
+      for (std::span<const std::uint8_t> span: spans)
+      {
+	if (Apex::text_to_host(span, host_text))
+	{
+	  break;
+	}
+      }
+      member.size = host_text.size();
+      tar.add_file(member, { std::span<const std::uint8_t>(host_text) });
+    }
+    else if (auto image_offset = disk.get_clean_file_offset(first_block, block_count))
+    {
+      if (! image_file.has_value())
       {
-	++file_count;
-	extract_file(disk,
-		     filename,
-		     dir_entry.get_first_block(),
-		     dir_entry.get_block_count());
+	image_file.emplace(disk.get_filename(), utility::HostFile::Mode::READ);
       }
+      tar.add_file(member, *image_file, *image_offset);
+    }
+    else
+    {
+      tar.add_file(member, spans);
+    }
+    ++file_count;
+  }
+  return file_count;
+}
+
+
+void export_image(AppleII::DiskImage::ImageFormat disk_image_format,
+		  const std::string& disk_image_fn,
+		  const std::vector<Apex::Filename>& patterns,
+		  Conversion conversion,
+		  const std::string& archive_fn,
+		  utility::OutputSink& out)
+{
+  Apex::Disk disk(disk_image_format);
+  disk.load(disk_image_fn, AppleII::DiskImage::Backing::MAPPED);
+  auto dir = disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
+
+  if (archive_fn.empty() || (archive_fn == "-"))
+  {
+    utility::HostFile archive_file(utility::HostFile::Mode::WRITE);
+    utility::TarWriter tar(archive_file);
+    std::size_t file_count = export_files(disk, dir, patterns, conversion, tar, out);
+    tar.finish();
+    out.print("{} files exported\n", file_count);
+    return;
+  }
+
+  // An archive file is written under a unique temporary name, and
+  // only synced to storage and renamed into place once complete, so
+  // that an error or crash doesn't leave a truncated archive, or
+  // destroy an existing one.
+  std::filesystem::path archive_path(archive_fn);
+  std::filesystem::path temp_fn = utility::create_temp_file(archive_path);
+  std::size_t file_count;
+  try
+  {
+    {
+      utility::HostFile archive_file(temp_fn, utility::HostFile::Mode::WRITE);
+      utility::TarWriter tar(archive_file);
+      file_count = export_files(disk, dir, patterns, conversion, tar, out);
+      tar.finish();
     }
+    utility::sync_to_storage(temp_fn, false);
+    std::filesystem::rename(temp_fn, archive_path);
   }
-  std::cout << std::format("{} files extracted\n", file_count);
+  catch (...)
+  {
+    std::error_code ec;
+    std::filesystem::remove(temp_fn, ec);
+    throw;
+  }
+  std::filesystem::path archive_dir = archive_path.parent_path();
+  utility::sync_to_storage(archive_dir.empty() ? std::filesystem::path(".") : archive_dir, true);
+  out.print("{} files exported\n", file_count);
 }
 
 
@@ -241,101 +598,946 @@ static Apex::Date get_host_file_modification_date(std::string filename)
   return Apex::Date(year, month, day);
 }
 
-void insert_file(Apex::Disk& disk,
+// Reads the data of a file being inserted into the spans, in order,
+// returning the number of bytes read.
+using InsertSource = std::function<std::size_t(const std::vector<std::span<std::uint8_t>>&)>;
+
+
+// Insert a file of size bytes, read from source, which is named in
+// error messages by source_name. Binary data is read directly into
+// the file's extent in the image.
+void insert_data(Apex::Disk& disk,
 		 Apex::Directory& dir,
-		 const Apex::Filename& filename)
+		 const Apex::Filename& filename,
+		 std::uintmax_t size,
+		 const Apex::Date& date,
+		 const InsertSource& source,
+		 const std::string& source_name,
+		 Apex::AllocationPolicy allocation_policy,
+		 bool replace_existing,
+		 Conversion conversion)
 {
-  std::string host_filename = utility::downcase_string(filename.to_string());
+  if (Apex::DirectoryEntry* existing = dir.find(filename))
+  {
+    if (! replace_existing)
+    {
+      throw std::runtime_error(std::format("file {} already exists in image", filename.to_string()));
+    }
+    existing->delete_file();
+  }
 
-  // get size of file, round up to integral number of blocks
-  std::uintmax_t host_file_size_bytes = std::filesystem::file_size(host_filename);
-  std::size_t file_size_blocks = (host_file_size_bytes + Apex::BYTES_PER_BLOCK - 1) / Apex::BYTES_PER_BLOCK;
+  // The size may come from an archive header, so is checked before
+  // anything is allocated for it. Host text may have CR LF line ends,
+  // which shrink by half.
+  std::uintmax_t volume_size = dir.volume_size_blocks() * Apex::BYTES_PER_BLOCK;
+  if (size > ((conversion != Conversion::BINARY) ? (2 * volume_size) : volume_size))
+  {
+    throw std::runtime_error(std::format("{} is too large for the image", source_name));
+  }
 
-  // get modification date of file
-  Apex::Date mod_date = get_host_file_modification_date(host_filename);
+  // round size up to integral number of blocks
+  std::size_t file_size_blocks = (size + Apex::BYTES_PER_BLOCK - 1) / Apex::BYTES_PER_BLOCK;
 
-  // XXX should make sure filename is not already in Apex directory
+  // text is converted before allocation, as that changes its size
+  std::vector<std::uint8_t> apex_text;
+  if (conversion != Conversion::BINARY)
+  {
+    std::vector<std::uint8_t> host_text(size);
+    if (source({ std::span<std::uint8_t>(host_text) }) != host_text.size())
+    {
+      throw std::runtime_error(std::format("premature eof reading \"{}\"", source_name));
+    }
+    Apex::text_from_host(host_text, conversion == Conversion::TEXT_HIGH_BIT, apex_text);
+    file_size_blocks = apex_text.size() / Apex::BYTES_PER_BLOCK;
+  }
 
   // allocate directory entry
   Apex::DirectoryEntry dir_entry = dir.allocate_directory_entry();
 
   // allocate blocks
-  std::uint16_t start_block = dir.find_free_blocks(file_size_blocks);
+  std::uint16_t start_block = dir.find_free_blocks(file_size_blocks, allocation_policy);
+  if (start_block == 0)
+  {
+    throw std::runtime_error(std::format("not enough contiguous free space for \"{}\"", source_name));
+  }
 
-  // read host file and write data to image
-  std::ifstream host_file(host_filename,
-			  std::ios_base::in | std::ios_base::binary);
-  if (! host_file.is_open())
+  if (conversion != Conversion::BINARY)
   {
-    throw std::runtime_error(std::format("unable to open host file \"{}\" to read", host_filename));
+    disk.write(start_block, file_size_blocks, apex_text.data());
   }
-  std::array<std::uint8_t, Apex::BYTES_PER_BLOCK> buffer;
-  for (std::uint16_t block_index = 0;
-       block_index < file_size_blocks;
-       ++block_index)
+  else
   {
-    host_file.read(reinterpret_cast<char*>(buffer.data()),
-		   Apex::BYTES_PER_BLOCK);
-    if (host_file.eof())
+    // read directly into the image, and clear the unused remainder of
+    // the last block
+    std::vector<std::span<std::uint8_t>> spans;
+    disk.get_writable_sector_spans(start_block, file_size_blocks, spans);
+    std::size_t count = source(spans);
+    if (count != size)
     {
-      if (block_index != (file_size_blocks - 1))
-      {
-	throw std::runtime_error(std::format("premature eof reading host file \"{}\"", host_filename));
-      }
+      throw std::runtime_error(std::format("premature eof reading \"{}\"", source_name));
     }
-    else if (host_file.fail())
+    for (std::span<std::uint8_t> span: spans)
     {
-      throw std::runtime_error(std::format("error reading host file \"{}\"", host_filename));
+      std::size_t used = std::min(count, span.size());
+      std::fill(span.begin() + used, span.end(), 0);
+      count -= used;
     }
-    disk.write(start_block + block_index, 1, buffer.data());
   }
 
   dir_entry.replace(Apex::DirectoryEntry::Status::VALID,
 		    filename,
 		    start_block,
 		    start_block + file_size_blocks - 1,
-		    mod_date);
+		    date);
+}
+
+
+void insert_file(Apex::Disk& disk,
+		 Apex::Directory& dir,
+		 const Apex::Filename& filename,
+		 Apex::AllocationPolicy allocation_policy,
+		 bool replace_existing,
+		 Conversion conversion)
+{
+  std::string host_filename = utility::downcase_string(filename.to_string());
+  utility::HostFile host_file(host_filename, utility::HostFile::Mode::READ);
+  insert_data(disk,
+	      dir,
+	      filename,
+	      host_file.get_size(),
+	      get_host_file_modification_date(host_filename),
+	      [&host_file](const std::vector<std::span<std::uint8_t>>& spans) { return host_file.read(spans); },
+	      std::format("host file \"{}\"", host_filename),
+	      allocation_policy,
+	      replace_existing,
+	      conversion);
+}
+
+
+std::size_t insert_files(Apex::Disk& disk,
+			 Apex::Directory& dir,
+			 const std::vector<Apex::Filename>& filenames,
+			 Apex::AllocationPolicy allocation_policy,
+			 bool replace_existing,
+			 Conversion conversion)
+{
+  for (const Apex::Filename& filename: filenames)
+  {
+    insert_file(disk, dir, filename, allocation_policy, replace_existing, conversion);
+  }
+  return filenames.size();
+}
+
+
+void insert(AppleII::DiskImage::ImageFormat disk_image_format,
+	    const std::string& disk_image_fn,
+	    const std::vector<Apex::Filename>& patterns,
+	    AppleII::DiskImage::SaveMode save_mode,
+	    Apex::AllocationPolicy allocation_policy,
+	    bool replace_existing,
+	    Conversion conversion,
+	    utility::OutputSink& out)
+{
+  Apex::Disk disk(disk_image_format);
+  disk.load(disk_image_fn);
+  auto dir = disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
+
+  Apex::Directory::Transaction transaction(dir);
+  std::size_t file_inserted_count = insert_files(disk, dir, patterns, allocation_policy, replace_existing, conversion);
+  transaction.commit();
+
+  disk.save(disk_image_fn, save_mode);
+  out.print("{} files inserted\n", file_inserted_count);
+}
+
+
+// Insert every regular file in a tar archive, reading each directly
+// into the extent allocated for it from the size in its header. The
+// Apex filename is the last component of the member name.
+std::size_t import_files(Apex::Disk& disk,
+			 Apex::Directory& dir,
+			 utility::TarReader& tar,
+			 Apex::AllocationPolicy allocation_policy,
+			 bool replace_existing,
+			 Conversion conversion,
+			 utility::OutputSink& out)
+{
+  utility::TarMember member;
+  std::size_t file_count = 0;
+  while (tar.next(member))
+  {
+    std::string name = std::filesystem::path(member.name).filename().string();
+    Apex::Filename filename;
+    try
+    {
+      filename = Apex::Filename(name);
+    }
+    catch (const Apex::FilenameError& e)
+    {
+      throw std::runtime_error(std::format("tar member \"{}\": {}", member.name, e.what()));
+    }
+    out.print("importing file {}, {} bytes\n", filename.to_string(), member.size);
+    if (out.get_format() != utility::OutputFormat::TABLE)
+    {
+      std::string filename_string = filename.to_string();
+      out.record({ { "imported", filename_string },
+		   { "size",     member.size } });
+    }
+    insert_data(disk,
+		dir,
+		filename,
+		member.size,
+		unix_time_to_apex_date(member.mtime),
+		[&tar](const std::vector<std::span<std::uint8_t>>& spans) { return tar.read(spans); },
+		std::format("tar member \"{}\"", member.name),
+		allocation_policy,
+		replace_existing,
+		conversion);
+    ++file_count;
+  }
+  return file_count;
+}
+
+
+// The directory is committed once, after the whole archive has been
+// read, so a bad archive leaves the image unchanged.
+void import_image(AppleII::DiskImage::ImageFormat disk_image_format,
+		  const std::string& disk_image_fn,
+		  AppleII::DiskImage::SaveMode save_mode,
+		  Apex::AllocationPolicy allocation_policy,
+		  bool replace_existing,
+		  Conversion conversion,
+		  const std::string& archive_fn,
+		  utility::OutputSink& out)
+{
+  Apex::Disk disk(disk_image_format);
+  disk.load(disk_image_fn);
+  auto dir = disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
+
+  std::optional<utility::HostFile> archive_file;
+  if (archive_fn.empty() || (archive_fn == "-"))
+  {
+    archive_file.emplace(utility::HostFile::Mode::READ);
+  }
+  else
+  {
+    archive_file.emplace(archive_fn, utility::HostFile::Mode::READ);
+  }
+  utility::TarReader tar(*archive_file);
+
+  Apex::Directory::Transaction transaction(dir);
+  std::size_t file_count = import_files(disk, dir, tar, allocation_policy, replace_existing, conversion, out);
+  transaction.commit();
+
+  disk.save(disk_image_fn, save_mode);
+  out.print("{} files imported\n", file_count);
+}
+
+
+// Copy the selected files from one image to another, each directly
+// from its extent in the source image to the extent allocated for it
+// in the destination, keeping its name and date.
+std::size_t copy_files(const Apex::Disk& source_disk,
+		       Apex::Directory& source_dir,
+		       const std::vector<Apex::Filename>& patterns,
+		       Apex::Disk& dest_disk,
+		       Apex::Directory& dest_dir,
+		       Apex::AllocationPolicy allocation_policy,
+		       bool replace_existing,
+		       utility::OutputSink& out)
+{
+  std::vector<std::span<const std::uint8_t>> source_spans;
+  std::vector<std::span<std::uint8_t>> dest_spans;
+  std::size_t file_count = 0;
+  for (const auto& source_entry: source_dir.entries(select_entries(source_dir, all_files_if_empty(patterns))))
+  {
+    Apex::Filename filename = source_entry.get_filename();
+    std::uint16_t first_block = source_entry.get_first_block();
+    std::uint16_t block_count = source_entry.get_block_count();
+    std::string filename_string = filename.to_string();
+    out.print("copying file {}, first block {}, block count {}\n",
+	      filename_string,
+	      first_block,
+	      block_count);
+    if (out.get_format() != utility::OutputFormat::TABLE)
+    {
+      out.record({ { "copied",      filename_string },
+		   { "first_block", first_block },
+		   { "block_count", block_count } });
+    }
+
+    if (Apex::DirectoryEntry* existing = dest_dir.find(filename))
+    {
+      if (! replace_existing)
+      {
+	throw std::runtime_error(std::format("file {} already exists in destination image", filename_string));
+      }
+      existing->delete_file();
+    }
+    Apex::DirectoryEntry dest_entry = dest_dir.allocate_directory_entry();
+    std::uint16_t start_block = dest_dir.find_free_blocks(block_count, allocation_policy);
+    if (start_block == 0)
+    {
+      throw std::runtime_error(std::format("not enough contiguous free space for {}", filename_string));
+    }
+
+    // The two images may split the extent into spans differently, as
+    // their formats or backing may differ.
+    source_spans.clear();
+    dest_spans.clear();
+    source_disk.get_sector_spans(first_block, block_count, source_spans);
+    dest_disk.get_writable_sector_spans(start_block, block_count, dest_spans);
+    auto dest = dest_spans.begin();
+    std::size_t dest_offset = 0;
+    for (std::span<const std::uint8_t> source: source_spans)
+    {
+      while (! source.empty())
+      {
+	std::size_t count = std::min(source.size(), dest->size() - dest_offset);
+	std::copy_n(source.begin(), count, dest->begin() + dest_offset);
+	source = source.subspan(count);
+	dest_offset += count;
+	if (dest_offset == dest->size())
+	{
+	  ++dest;
+	  dest_offset = 0;
+	}
+      }
+    }
+
+    dest_entry.replace(Apex::DirectoryEntry::Status::VALID,
+		       filename,
+		       start_block,
+		       start_block + block_count - 1,
+		       source_entry.get_date());
+    ++file_count;
+  }
+  return file_count;
+}
+
+
+// The destination directory is committed once, after all of the files
+// have been copied.
+void cp(AppleII::DiskImage::ImageFormat disk_image_format,
+	const std::string& source_image_fn,
+	const std::vector<Apex::Filename>& patterns,
+	const std::string& dest_image_fn,
+	AppleII::DiskImage::SaveMode save_mode,
+	Apex::AllocationPolicy allocation_policy,
+	bool replace_existing,
+	utility::OutputSink& out)
+{
+  std::error_code ec;
+  if (std::filesystem::equivalent(source_image_fn, dest_image_fn, ec))
+  {
+    throw std::runtime_error("source and destination are the same image");
+  }
+
+  Apex::Disk source_disk(disk_image_format);
+  source_disk.load(source_image_fn, AppleII::DiskImage::Backing::MAPPED);
+  auto source_dir = source_disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
+
+  Apex::Disk dest_disk(disk_image_format);
+  dest_disk.load(dest_image_fn);
+  auto dest_dir = dest_disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
+
+  Apex::Directory::Transaction transaction(dest_dir);
+  std::size_t file_count = copy_files(source_disk, source_dir, patterns, dest_disk, dest_dir, allocation_policy, replace_existing, out);
+  transaction.commit();
+
+  dest_disk.save(dest_image_fn, save_mode);
+  out.print("{} files copied\n", file_count);
+}
+
+
+// Write data over blocks of the image starting at first_block, only
+// where it differs from what is already there. Returns the number of
+// blocks written.
+static std::size_t write_changed_blocks(Apex::Disk& disk,
+					std::uint16_t first_block,
+					const std::vector<std::uint8_t>& data)
+{
+  std::size_t block_count = data.size() / Apex::BYTES_PER_BLOCK;
+  std::vector<std::span<const std::uint8_t>> spans;
+  disk.get_sector_spans(first_block, block_count, spans);
+  std::size_t written = 0;
+  std::size_t block = 0;
+  for (std::span<const std::uint8_t> span: spans)
+  {
+    for (std::size_t offset = 0; offset < span.size(); offset += Apex::BYTES_PER_BLOCK, block++)
+    {
+      const std::uint8_t* new_block = data.data() + block * Apex::BYTES_PER_BLOCK;
+      if (! Apex::blocks_equal(span.data() + offset, new_block))
+      {
+	disk.write(first_block + block, 1, new_block);
+	++written;
+      }
+    }
+  }
+  return written;
+}
+
+
+struct SyncCounts
+{
+  std::size_t added = 0;
+  std::size_t updated = 0;
+  std::size_t redated = 0;
+  std::size_t removed = 0;
+  std::size_t unchanged = 0;
+  std::size_t blocks_written = 0;
+};
+
+
+// Make the files of the image that match the patterns the same as
+// the regular files of a host directory that match them. Files that
+// are missing from the host directory are deleted. A changed file is
+// rewritten in its existing extent when it fits there, or in the free
+// space following it, writing only the blocks that differ; otherwise
+// it is inserted anew. A file is unchanged if its contents and date
+// are the same.
+SyncCounts sync_files(Apex::Disk& disk,
+		      Apex::Directory& dir,
+		      const std::filesystem::path& host_dir,
+		      const std::vector<Apex::Filename>& patterns,
+		      Apex::AllocationPolicy allocation_policy,
+		      Conversion conversion,
+		      utility::OutputSink& out)
+{
+  std::vector<Apex::Pattern> compiled_patterns = compile_patterns(all_files_if_empty(patterns));
+  auto matches = [&compiled_patterns](const Apex::Filename& filename)
+  {
+    return std::any_of(compiled_patterns.begin(), compiled_patterns.end(),
+		       [&filename](const Apex::Pattern& pattern) { return pattern.match(filename); });
+  };
+
+  // host files, sorted by name, for consistent allocation and output
+  std::vector<std::pair<Apex::Filename, std::filesystem::path>> host_files;
+  for (const std::filesystem::directory_entry& host_entry: std::filesystem::directory_iterator(host_dir))
+  {
+    if (! host_entry.is_regular_file())
+    {
+      continue;
+    }
+    // A host file whose name can't be an Apex filename can't match a
+    // pattern, so it is skipped, with a warning only when all files
+    // are being synced.
+    std::string name = host_entry.path().filename().string();
+    Apex::Filename filename;
+    try
+    {
+      filename = Apex::Filename(name).upcase();
+    }
+    catch (const Apex::FilenameError& e)
+    {
+      if (patterns.empty())
+      {
+	out.print("skipping host file \"{}\": {}\n", host_entry.path().string(), e.what());
+      }
+      continue;
+    }
+    if (matches(filename))
+    {
+      host_files.emplace_back(filename, host_entry.path());
+    }
+  }
+  std::sort(host_files.begin(), host_files.end(),
+	    [](const auto& a, const auto& b) { return a.first < b.first; });
+  for (std::size_t i = 1; i < host_files.size(); i++)
+  {
+    if (host_files[i].first == host_files[i - 1].first)
+    {
+      throw std::runtime_error(std::format("host files \"{}\" and \"{}\" have the same Apex filename",
+					   host_files[i - 1].second.string(),
+					   host_files[i].second.string()));
+    }
+  }
+
+  SyncCounts counts;
+  auto report = [&out](std::string_view change, const Apex::Filename& filename)
+  {
+    std::string filename_string = filename.to_string();
+    out.print("{} {}\n", change, filename_string);
+    if (out.get_format() != utility::OutputFormat::TABLE)
+    {
+      out.record({ { "change",   change },
+		   { "filename", filename_string } });
+    }
+  };
+
+  // Deleting first leaves the most free space for files that have to
+  // move.
+  std::vector<Apex::Filename> removed;
+  for (const auto& entry: dir.valid_entries())
+  {
+    Apex::Filename filename = entry.get_filename();
+    if (matches(filename) &&
+	std::none_of(host_files.begin(), host_files.end(),
+		     [&filename](const auto& host_file) { return host_file.first == filename; }))
+    {
+      removed.push_back(filename);
+    }
+  }
+  for (const Apex::Filename& filename: removed)
+  {
+    dir.find(filename)->delete_file();
+    report("removed", filename);
+    ++counts.removed;
+  }
+
+  for (const auto& [filename, host_path]: host_files)
+  {
+    // the new contents of the file, in whole blocks
+    utility::HostFile host_file(host_path, utility::HostFile::Mode::READ);
+    std::vector<std::uint8_t> data(host_file.get_size());
+    if (host_file.read({ std::span<std::uint8_t>(data) }) != data.size())
+    {
+      throw std::runtime_error(std::format("premature eof reading host file \"{}\"", host_path.string()));
+    }
+    if (conversion != Conversion::BINARY)
+    {
+      std::vector<std::uint8_t> apex_text;
+      Apex::text_from_host(data, conversion == Conversion::TEXT_HIGH_BIT, apex_text);
+      data = std::move(apex_text);
+    }
+    std::size_t block_count = std::max<std::size_t>((data.size() + Apex::BYTES_PER_BLOCK - 1) / Apex::BYTES_PER_BLOCK, 1);
+    data.resize(block_count * Apex::BYTES_PER_BLOCK, 0);
+    Apex::Date date = get_host_file_modification_date(host_path.string());
+
+    Apex::DirectoryEntry* existing = dir.find(filename);
+    if (existing)
+    {
+      std::uint16_t first_block = existing->get_first_block();
+      bool redate = existing->get_date().get_raw() != date.get_raw();
+      bool resized = existing->get_block_count() != block_count;
+      bool in_place = ! resized;
+      Apex::DirectoryEntry entry = *existing;
+      if (resized)
+      {
+	// Once its blocks are released, the file fits in place if the
+	// free extent they are part of holds it from its first block.
+	entry.delete_file();
+	const Apex::FreeExtentMap& free_extents = dir.get_free_extents();
+	in_place = std::any_of(free_extents.begin(), free_extents.end(),
+			       [first_block, block_count](const Apex::BlockRange& extent)
+			       {
+				 return (extent.begin <= first_block) && (first_block + block_count <= extent.end);
+			       });
+	redate = true;
+      }
+      if (in_place)
+      {
+	std::size_t written = write_changed_blocks(disk, first_block, data);
+	counts.blocks_written += written;
+	if (redate)
+	{
+	  // the directory entry only changes if the date or extent does
+	  if (entry.get_status() == Apex::DirectoryEntry::Status::VALID)
+	  {
+	    entry.delete_file();
+	  }
+	  entry.replace(Apex::DirectoryEntry::Status::VALID,
+			filename,
+			first_block,
+			first_block + block_count - 1,
+			date);
+	}
+	if (written || resized)
+	{
+	  report("updated", filename);
+	  ++counts.updated;
+	}
+	else if (redate)
+	{
+	  report("redated", filename);
+	  ++counts.redated;
+	}
+	else
+	{
+	  ++counts.unchanged;
+	}
+	continue;
+      }
+    }
+
+    std::size_t offset = 0;
+    insert_data(disk,
+		dir,
+		filename,
+		data.size(),
+		date,
+		[&data, &offset](const std::vector<std::span<std::uint8_t>>& spans)
+		{
+		  std::size_t start = offset;
+		  for (std::span<std::uint8_t> span: spans)
+		  {
+		    std::size_t size = std::min(span.size(), data.size() - offset);
+		    std::copy_n(data.begin() + offset, size, span.begin());
+		    offset += size;
+		  }
+		  return offset - start;
+		},
+		std::format("host file \"{}\"", host_path.string()),
+		allocation_policy,
+		false,
+		Conversion::BINARY);
+    counts.blocks_written += block_count;
+    report(existing ? "updated" : "added", filename);
+    ++(existing ? counts.updated : counts.added);
+  }
+  return counts;
+}
+
+
+// The directory is committed once, after all files have been synced,
+// and the image isn't written at all if nothing changed.
+void sync(AppleII::DiskImage::ImageFormat disk_image_format,
+	  const std::string& host_dir,
+	  const std::string& disk_image_fn,
+	  const std::vector<Apex::Filename>& patterns,
+	  AppleII::DiskImage::SaveMode save_mode,
+	  Apex::AllocationPolicy allocation_policy,
+	  Conversion conversion,
+	  utility::OutputSink& out)
+{
+  if (! std::filesystem::is_directory(host_dir))
+  {
+    throw std::runtime_error(std::format("\"{}\" isn't a directory", host_dir));
+  }
+
+  Apex::Disk disk(disk_image_format);
+  disk.load(disk_image_fn);
+  auto dir = disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
+
+  Apex::Directory::Transaction transaction(dir);
+  SyncCounts counts = sync_files(disk, dir, host_dir, patterns, allocation_policy, conversion, out);
+  transaction.commit();
+
+  if (counts.added || counts.updated || counts.redated || counts.removed)
+  {
+    disk.save(disk_image_fn, save_mode);
+  }
+  out.print("{} files added, {} updated, {} redated, {} removed, {} unchanged, {} file blocks written\n",
+	    counts.added,
+	    counts.updated,
+	    counts.redated,
+	    counts.removed,
+	    counts.unchanged,
+	    counts.blocks_written);
+}
+
+
+// Names of the files in an image whose extents overlap a range of
+// blocks, or "directory" for the directory blocks, added to names
+// unless already present.
+static void describe_blocks(Apex::Directory& dir,
+			    const Apex::BlockRange& range,
+			    std::vector<std::string>& names)
+{
+  auto add = [&names](std::string name)
+  {
+    if (std::find(names.begin(), names.end(), name) == names.end())
+    {
+      names.push_back(std::move(name));
+    }
+  };
+  for (std::uint16_t start: Apex::Disk::directory_start_block)
+  {
+    if ((range.begin < start + Apex::BLOCKS_PER_DIRECTORY) && (start < range.end))
+    {
+      add("directory");
+    }
+  }
+  for (const auto& entry: dir.valid_entries())
+  {
+    if ((range.begin <= entry.get_last_block()) && (entry.get_first_block() < range.end))
+    {
+      add(entry.get_filename().to_string());
+    }
+  }
+}
+
+
+// Compare two images, reporting the files that were added, removed,
+// or changed, and the runs of blocks that differ, with the files that
+// occupy them. Optionally writes a patch that turns the first image
+// into the second. Returns true if the images differ.
+bool diff(AppleII::DiskImage::ImageFormat disk_image_format,
+	  const std::string& a_image_fn,
+	  const std::string& b_image_fn,
+	  const std::string& patch_fn,
+	  utility::OutputSink& out)
+{
+  Apex::Disk a_disk(disk_image_format);
+  a_disk.load(a_image_fn, AppleII::DiskImage::Backing::MAPPED);
+  auto a_dir = a_disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
+  Apex::Disk b_disk(disk_image_format);
+  b_disk.load(b_image_fn, AppleII::DiskImage::Backing::MAPPED);
+  auto b_dir = b_disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
+
+  auto report = [&out](std::string_view kind,
+		       std::string_view change,
+		       std::string_view filename,
+		       std::uint16_t first_block,
+		       std::uint16_t block_count)
+  {
+    out.record({ { "kind",        kind,         6 },
+		 { "change",      change,       8 },
+		 { "filename",    filename,    12 },
+		 { "first_block", first_block,  6 },
+		 { "block_count", block_count,  6 } });
+  };
+
+  out.print("                                first   block\n"
+	    "kind    change    filename      block   count\n"
+	    "------  --------  ------------  ------  ------\n");
+
+  // Files are matched by name. A file whose contents are the same,
+  // but which has moved or been redated, is reported as such.
+  std::size_t file_change_count = 0;
+  for (const auto& a_entry: a_dir.valid_entries())
+  {
+    Apex::Filename filename = a_entry.get_filename();
+    std::string filename_string = filename.to_string();
+    const Apex::DirectoryEntry* b_entry = b_dir.find(filename);
+    std::string_view change;
+    if (! b_entry)
+    {
+      change = "removed";
+    }
+    else if ((a_entry.get_block_count() != b_entry->get_block_count()) ||
+	     (! Apex::extents_equal(a_disk, a_entry.get_first_block(),
+				    b_disk, b_entry->get_first_block(),
+				    a_entry.get_block_count())))
+    {
+      change = "changed";
+    }
+    else if (a_entry.get_first_block() != b_entry->get_first_block())
+    {
+      change = "moved";
+    }
+    else if (a_entry.get_date().get_raw() != b_entry->get_date().get_raw())
+    {
+      change = "redated";
+    }
+    else
+    {
+      continue;
+    }
+    const Apex::DirectoryEntry& entry = b_entry ? *b_entry : a_entry;
+    report("file", change, filename_string, entry.get_first_block(), entry.get_block_count());
+    ++file_change_count;
+  }
+  for (const auto& b_entry: b_dir.valid_entries())
+  {
+    if (! a_dir.find(b_entry.get_filename()))
+    {
+      std::string filename_string = b_entry.get_filename().to_string();
+      report("file", "added", filename_string, b_entry.get_first_block(), b_entry.get_block_count());
+      ++file_change_count;
+    }
+  }
+
+  std::vector<Apex::BlockRange> runs = Apex::diff_blocks(a_disk, b_disk);
+  std::size_t block_change_count = 0;
+  for (const Apex::BlockRange& run: runs)
+  {
+    std::vector<std::string> names;
+    describe_blocks(b_dir, run, names);
+    describe_blocks(a_dir, run, names);
+    std::string owners;
+    for (const std::string& name: names)
+    {
+      owners += owners.empty() ? name : ("," + name);
+    }
+    report("blocks", "differ", owners.empty() ? "free" : owners, run.begin, run.end - run.begin);
+    block_change_count += run.end - run.begin;
+  }
+
+  out.print("\n"
+	    "{} files differ, {} blocks differ in {} runs\n",
+	    file_change_count,
+	    block_change_count,
+	    runs.size());
+
+  if (! patch_fn.empty())
+  {
+    Apex::ImagePatch patch(a_disk, b_disk);
+    patch.save(patch_fn);
+    out.print("patch written to \"{}\", {} bytes\n", patch_fn, std::filesystem::file_size(patch_fn));
+  }
+  return ! runs.empty();
 }
 
 
-void insert(AppleII::DiskImage::ImageFormat disk_image_format,
-	    const std::string& disk_image_fn,
-	    const std::vector<Apex::Filename>& patterns)
+// Only the changed sectors are written back, unless the image is
+// saved in full.
+void patch(AppleII::DiskImage::ImageFormat disk_image_format,
+	   const std::string& disk_image_fn,
+	   const std::string& patch_fn,
+	   AppleII::DiskImage::SaveMode save_mode,
+	   utility::OutputSink& out)
 {
+  Apex::ImagePatch image_patch(patch_fn);
   Apex::Disk disk(disk_image_format);
   disk.load(disk_image_fn);
-  auto dir = disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
-
-  std::size_t file_inserted_count = 0;
-  for (const Apex::Filename& filename: patterns)
+  image_patch.apply(disk);
+  std::size_t block_count = 0;
+  for (const Apex::BlockRange& run: image_patch.get_runs())
   {
-    insert_file(disk, dir, filename);
-    ++file_inserted_count;
+    block_count += run.end - run.begin;
   }
-
-  disk.save(disk_image_fn);
-  std::cout << std::format("{} files inserted\n", file_inserted_count);
+  disk.save(disk_image_fn, save_mode);
+  out.print("{} blocks patched in {} runs\n", block_count, image_patch.get_runs().size());
 }
 
 
 void create(AppleII::DiskImage::ImageFormat disk_image_format,
 	    const std::string& disk_image_fn,
-	    const std::vector<Apex::Filename>& patterns)
+	    const std::vector<Apex::Filename>& patterns,
+	    Apex::AllocationPolicy allocation_policy,
+	    bool replace_existing,
+	    Conversion conversion,
+	    utility::OutputSink& out)
 {
   Apex::Disk disk(disk_image_format);
   disk.initialize();
   
   auto dir = disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
 
-  std::size_t file_inserted_count = 0;
-  for (const Apex::Filename& filename: patterns)
+  Apex::Directory::Transaction transaction(dir);
+  std::size_t file_inserted_count = insert_files(disk, dir, patterns, allocation_policy, replace_existing, conversion);
+  transaction.commit();
+
+  disk.save(disk_image_fn);
+  out.print("image created, {} files inserted\n", file_inserted_count);
+}
+
+
+enum class SessionCommand
+{
+  LS,
+  INSERT,
+  EXTRACT,
+  RM,
+  FREE,
+  COMMIT,
+};
+
+
+// Run commands read from a script file, or from standard input if
+// script_fn is empty or "-", on one image that is loaded once and kept
+// in memory. Each line is a command followed by filenames or patterns,
+// as for the corresponding summit command. Blank lines and lines
+// starting with '#' are ignored. Changes are written back to the image
+// file only by the commit command. An error ends the session, and
+// discards uncommitted changes. Output is flushed after each command,
+// so that the session can be driven interactively.
+void session(const CommandOptions& options,
+	     const std::string& disk_image_fn,
+	     const std::string& script_fn,
+	     utility::OutputSink& out,
+	     std::ostream& err)
+{
+  std::ifstream script_file;
+  std::istream* script = &std::cin;
+  if ((! script_fn.empty()) && (script_fn != "-"))
   {
-    insert_file(disk, dir, filename);
-    ++file_inserted_count;
+    script_file.open(script_fn);
+    if (! script_file.is_open())
+    {
+      throw std::runtime_error(std::format("unable to open script \"{}\" to read", script_fn));
+    }
+    script = &script_file;
   }
 
-  disk.save(disk_image_fn);
-  std::cout << std::format("image created, {} files inserted\n", file_inserted_count);
+  Apex::Disk disk(options.disk_image_format);
+  disk.load(disk_image_fn);
+  auto dir = disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
+
+  std::string line;
+  std::size_t line_number = 0;
+  while (std::getline(*script, line))
+  {
+    ++line_number;
+    std::istringstream words(line);
+    std::string command_word;
+    if ((! (words >> command_word)) || (command_word.front() == '#'))
+    {
+      continue;
+    }
+    try
+    {
+      auto command = magic_enum::enum_cast<SessionCommand>(command_word, magic_enum::case_insensitive);
+      if (! command.has_value())
+      {
+	throw std::runtime_error(std::format("unrecognized command \"{}\"", command_word));
+      }
+      std::vector<Apex::Filename> filenames;
+      for (std::string word; words >> word; )
+      {
+	filenames.emplace_back(word);
+      }
+      if ((command == SessionCommand::INSERT || command == SessionCommand::RM) && filenames.empty())
+      {
+	throw std::runtime_error(std::format("{} requires at least one filename", command_word));
+      }
+
+      switch (command.value())
+      {
+      case SessionCommand::LS:
+	list_files(dir, filenames, out);
+	break;
+      case SessionCommand::FREE:
+	list_free_blocks(dir, out, err);
+	break;
+      case SessionCommand::EXTRACT:
+	out.print("{} files extracted\n",
+		  extract_files(disk, dir, filenames, options.conversion, std::filesystem::path(), nullptr, out));
+	break;
+      case SessionCommand::INSERT:
+	{
+	  Apex::Directory::Transaction transaction(dir);
+	  std::size_t file_inserted_count = insert_files(disk, dir, filenames, options.allocation_policy, options.replace_existing, options.conversion);
+	  transaction.commit();
+	  out.print("{} files inserted\n", file_inserted_count);
+	}
+	break;
+      case SessionCommand::RM:
+	{
+	  Apex::Directory::Transaction transaction(dir);
+	  std::size_t file_deleted_count = delete_files(dir, filenames, out);
+	  transaction.commit();
+	  out.print("{} files deleted\n", file_deleted_count);
+	}
+	break;
+      case SessionCommand::COMMIT:
+	{
+	  std::size_t sector_count = disk.get_dirty_sector_count();
+	  if (sector_count)
+	  {
+	    disk.save(disk_image_fn, options.save_mode);
+	  }
+	  out.print("{} modified sectors written\n", sector_count);
+	}
+	break;
+      }
+      out.flush();
+    }
+    catch (const std::exception& e)
+    {
+      out.flush();
+      throw std::runtime_error(std::format("{} line {}: {}",
+					   script_fn.empty() ? "-" : script_fn,
+					   line_number,
+					   e.what()));
+    }
+  }
+
+  if (std::size_t sector_count = disk.get_dirty_sector_count())
+  {
+    err << std::format("warning: {} modified sectors not committed\n", sector_count);
+  }
 }
 
 
@@ -356,6 +1558,48 @@ void validate(boost::any& v,
 }
 
 
+namespace Apex
+{
+  // must be in the Apex namespace to be found by argument-dependent lookup
+  void validate(boost::any& v,
+		const std::vector<std::string>& values,
+		AllocationPolicy*,
+		int)
+  {
+    const std::string& input = values.at(0);
+
+    auto policy = magic_enum::enum_cast<AllocationPolicy>(input, magic_enum::case_insensitive);
+    if (! policy.has_value())
+    {
+      throw po::validation_error(po::validation_error::invalid_option_value,
+				 "unrecognized allocation policy");
+    }
+    v = boost::any(policy.value());
+  }
+} // end namespace Apex
+
+
+namespace utility
+{
+  // must be in the utility namespace to be found by argument-dependent lookup
+  void validate(boost::any& v,
+		const std::vector<std::string>& values,
+		OutputFormat*,
+		int)
+  {
+    const std::string& input = values.at(0);
+
+    auto format = magic_enum::enum_cast<OutputFormat>(input, magic_enum::case_insensitive);
+    if (! format.has_value())
+    {
+      throw po::validation_error(po::validation_error::invalid_option_value,
+				 "unrecognized output format");
+    }
+    v = boost::any(format.value());
+  }
+} // end namespace utility
+
+
 #if 0
 void validate(boost::any& v,
 	      const std::vector<std::string>& values,
@@ -376,15 +1620,227 @@ void validate(boost::any& v,
 #endif	      
 
 
+// Files extracted from an image go into output_dir, or the current
+// directory if output_dir is empty, and are written concurrently by
+// the workers of extract_pool, if it isn't null.
+void run_command(Command command,
+		 const CommandOptions& options,
+		 const std::string& disk_image_fn,
+		 const std::filesystem::path& output_dir,
+		 utility::WorkerPool* extract_pool,
+		 utility::OutputSink& out,
+		 std::ostream& err)
+{
+  switch (command)
+  {
+  case Command::LS:      ls     (options.disk_image_format, disk_image_fn, options.patterns, out); break;
+  case Command::EXTRACT: extract(options.disk_image_format, disk_image_fn, options.patterns, options.conversion, output_dir, extract_pool, out); break;
+  case Command::INSERT:  insert (options.disk_image_format, disk_image_fn, options.patterns, options.save_mode, options.allocation_policy, options.replace_existing, options.conversion, out); break;
+  case Command::CREATE:  create (options.disk_image_format, disk_image_fn, options.patterns, options.allocation_policy, options.replace_existing, options.conversion, out); break;
+  case Command::RM:      rm     (options.disk_image_format, disk_image_fn, options.patterns, options.save_mode, out); break;
+  case Command::FREE:    free   (options.disk_image_format, disk_image_fn, out, err); break;
+  case Command::EXPORT:  export_image(options.disk_image_format, disk_image_fn, options.patterns, options.conversion, options.archive_fn, out); break;
+  case Command::IMPORT:  import_image(options.disk_image_format, disk_image_fn, options.save_mode, options.allocation_policy, options.replace_existing, options.conversion, options.archive_fn, out); break;
+  case Command::SESSION:
+  case Command::CP:
+  case Command::DIFF:
+  case Command::PATCH:
+  case Command::SYNC:
+    throw std::invalid_argument(std::format("{} command can't be used on multiple images",
+					    utility::downcase_string(std::string(magic_enum::enum_name(command)))));
+  }
+}
+
+
+// Commands that only read an image, run on an image already loaded,
+// such as one read from an archive member.
+void run_loaded_command(Command command,
+			const CommandOptions& options,
+			Apex::Disk& disk,
+			const std::filesystem::path& output_dir,
+			utility::OutputSink& out,
+			std::ostream& err)
+{
+  auto dir = disk.get_directory(Apex::Disk::DirectoryType::PRIMARY);
+  switch (command)
+  {
+  case Command::LS:
+    list_files(dir, options.patterns, out);
+    break;
+  case Command::FREE:
+    list_free_blocks(dir, out, err);
+    break;
+  case Command::EXTRACT:
+    out.print("{} files extracted\n",
+	      extract_files(disk, dir, options.patterns, options.conversion, output_dir, nullptr, out));
+    break;
+  default:
+    throw std::invalid_argument(std::format("{} command can't be used on an image in an archive",
+					    utility::downcase_string(std::string(magic_enum::enum_name(command)))));
+  }
+}
+
+
+// An image for batch mode, either a file, or the contents of an
+// archive member.
+struct BatchImage
+{
+  std::string name;
+  std::optional<std::vector<std::uint8_t>> data;
+};
+
+
+// Run a command on many images, using a pool of worker threads. The
+// output of each image is buffered, and written in the order the
+// images were given, through one sink, so that the structured formats
+// produce a single stream of records, each labeled with its image. At
+// most a few images per worker are in progress or waiting to be
+// written at any time, so memory use doesn't grow with the number of
+// images, even when their contents are read from an archive. A
+// failure on one image is reported without stopping the others; an
+// error getting the next image stops the batch once the images
+// already started have been reported. Files extracted from an image go
+// into a directory named after the image, minus its extension and any
+// ".gz", and are written one at a time, as the images are already in
+// parallel.
+// Returns the number of images that failed.
+std::size_t run_batch(Command command,
+		      const CommandOptions& options,
+		      std::function<bool(BatchImage&)> next_image_fn,
+		      unsigned job_count)
+{
+  struct ImageResult
+  {
+    std::unique_ptr<utility::OutputSink> output;
+    std::string errors;
+    bool failed;
+  };
+
+  utility::OutputSink out(options.output_format, &std::cout);
+  utility::WorkerPool pool(job_count);
+  const std::size_t max_outstanding = 4 * pool.get_thread_count();
+  std::deque<std::pair<std::string, std::future<ImageResult>>> outstanding;
+  std::size_t image_count = 0;
+  std::size_t failure_count = 0;
+
+  auto write_oldest = [&]()
+  {
+    auto& [disk_image_fn, future] = outstanding.front();
+    ImageResult result = future.get();
+    out.print("{}:\n", disk_image_fn);
+    out.append(*result.output);
+    if (! result.errors.empty())
+    {
+      out.flush();
+      std::cerr << result.errors;
+    }
+    out.print("\n");
+    if (result.failed)
+    {
+      ++failure_count;
+    }
+    outstanding.pop_front();
+  };
+
+  std::exception_ptr input_error;
+  try
+  {
+    BatchImage image;
+    while (next_image_fn(image))
+    {
+      if (outstanding.size() >= max_outstanding)
+      {
+	write_oldest();
+      }
+      std::string disk_image_fn = image.name;
+      auto task = [command, &options, image = std::move(image)]()
+      {
+	auto out = std::make_unique<utility::OutputSink>(options.output_format);
+	out->set_context("image", image.name);
+	std::ostringstream err;
+	bool failed = false;
+	try
+	{
+	  std::filesystem::path output_dir(image.name);
+	  if (output_dir.extension() == ".gz")
+	  {
+	    output_dir.replace_extension();
+	  }
+	  output_dir.replace_extension();
+	  if (! image.data)
+	  {
+	    run_command(command, options, image.name, output_dir, nullptr, *out, err);
+	  }
+	  else
+	  {
+	    // archive member names come from elsewhere, so mustn't
+	    // direct extraction outside the current directory
+	    if ((command == Command::EXTRACT) &&
+		(output_dir.is_absolute() ||
+		 (std::find(output_dir.begin(), output_dir.end(), "..") != output_dir.end())))
+	    {
+	      throw std::runtime_error("unsafe archive member name");
+	    }
+	    Apex::Disk disk(options.disk_image_format);
+	    disk.load(std::span<const std::uint8_t>(*image.data));
+	    run_loaded_command(command, options, disk, output_dir, *out, err);
+	  }
+	}
+	catch (const std::exception& e)
+	{
+	  err << std::format("error processing image \"{}\": {}\n", image.name, e.what());
+	  failed = true;
+	}
+	return ImageResult { std::move(out), err.str(), failed };
+      };
+      outstanding.emplace_back(disk_image_fn, pool.submit(std::move(task)));
+      ++image_count;
+      image = BatchImage();
+    }
+  }
+  catch (const std::exception&)
+  {
+    input_error = std::current_exception();
+  }
+  while (! outstanding.empty())
+  {
+    write_oldest();
+  }
+
+  out.print("{} images processed, {} failed\n", image_count, failure_count);
+  if (input_error)
+  {
+    out.flush();
+    std::rethrow_exception(input_error);
+  }
+  return failure_count;
+}
+
+
 int main(int argc, char *argv[])
 {
   Command command;
   std::string disk_image_fn;
   std::vector<std::string> pattern_strings;
-  std::vector<Apex::Filename> patterns;
-  AppleII::DiskImage::ImageFormat disk_image_format = AppleII::DiskImage::ImageFormat::APEX_ORDER;
-
-  std::cout << std::format("{} version {} {}\n", name, app_version_string, release_type_string);
+  std::vector<std::string> option_pattern_strings;
+  std::vector<std::string> image_fns;  // batch mode images named on the command line
+  CommandOptions options
+  {
+    .disk_image_format = AppleII::DiskImage::ImageFormat::APEX_ORDER,
+    .patterns          = {},
+    .save_mode         = AppleII::DiskImage::SaveMode::IN_PLACE,
+    .allocation_policy = Apex::AllocationPolicy::FIRST_FIT,
+    .replace_existing  = false,
+    .conversion        = Conversion::BINARY,
+    .output_format     = utility::OutputFormat::TABLE,
+    .archive_fn        = {},
+  };
+  bool batch = false;
+  std::string images_from;
+  std::string images_from_tar;
+  std::string patch_fn;
+  std::ostream* report_stream = &std::cout;
+  unsigned job_count = 0;
 
   try
   {
@@ -393,7 +1849,20 @@ int main(int argc, char *argv[])
 
     po::options_description gen_opts("Options");
     gen_opts.add_options()
-      ("help",                                           "output help message");
+      ("help",                                           "output help message")
+      ("safe",                                           "write modified image to a temporary file, then rename")
+      ("allocation", po::value<Apex::AllocationPolicy>(&options.allocation_policy), "free space allocation policy for insert and create: first_fit, best_fit, or worst_fit")
+      ("replace",                                        "insert replaces files that already exist in the image")
+      ("text",                                           "extract and insert convert between Apex text and host text")
+      ("high-bit",                                       "with --text, insert sets the high bit of each character")
+      ("format",   po::value<utility::OutputFormat>(&options.output_format), "output format for ls, free, and batch mode: table, csv, jsonl, or nul")
+      ("patch",    po::value<std::string>(&patch_fn),      "diff writes a patch file that turns the first image into the second")
+      ("archive",  po::value<std::string>(&options.archive_fn), "tar archive written by export or read by import, or - for standard output or input (the default)")
+      ("batch",                                          "run the command on each image named on the command line")
+      ("images-from", po::value<std::string>(&images_from), "batch mode, reading image filenames one per line from a file, or - for standard input")
+      ("images-from-tar", po::value<std::string>(&images_from_tar), "batch mode for ls, extract, or free, reading the images from the members of a tar archive, or - for standard input")
+      ("pattern",  po::value<std::vector<std::string>>(&option_pattern_strings), "filename or pattern for the command, may be repeated (needed for batch mode)")
+      ("jobs",     po::value<unsigned>(&job_count),      "number of images to process concurrently in batch mode, or files to extract concurrently from a single image (default one per processor)");
 
     po::options_description hidden_opts("Hidden options:");
     hidden_opts.add_options()
@@ -419,6 +1888,22 @@ int main(int argc, char *argv[])
 	      options(cmdline_opts).positional(positional_opts).run(), vm);
     po::notify(vm);
 
+    // When an archive goes to standard output, messages go to
+    // standard error instead.
+    if ((vm.count("command") == 1) &&
+	(command == Command::EXPORT) &&
+	(options.archive_fn.empty() || (options.archive_fn == "-")))
+    {
+      report_stream = &std::cerr;
+    }
+
+    // The structured formats are meant for other programs, so they
+    // contain only records.
+    if (options.output_format == utility::OutputFormat::TABLE)
+    {
+      *report_stream << std::format("{} version {} {}\n", name, app_version_string, release_type_string);
+    }
+
     if (vm.count("help"))
     {
       std::cerr << "Usage: " << argv[0] << " [options]\n\n";
@@ -426,6 +1911,25 @@ int main(int argc, char *argv[])
       std::exit(0);
     }
 
+    if (vm.count("safe"))
+    {
+      options.save_mode = AppleII::DiskImage::SaveMode::SAFE;
+    }
+
+    options.replace_existing = vm.count("replace") > 0;
+
+    if (vm.count("text"))
+    {
+      options.conversion = vm.count("high-bit") ? Conversion::TEXT_HIGH_BIT : Conversion::TEXT;
+    }
+    else if (vm.count("high-bit"))
+    {
+      throw po::validation_error(po::validation_error::invalid_option, "high-bit");
+    }
+
+    conflicting_options(vm, { "images-from", "images-from-tar" });
+    batch = (vm.count("batch") > 0) || (vm.count("images-from") > 0) || (vm.count("images-from-tar") > 0);
+
     if (vm.count("command") != 1)
     {
       throw po::validation_error(po::validation_error::at_least_one_value_required,
@@ -433,12 +1937,39 @@ int main(int argc, char *argv[])
     }
 
 
-    if (vm.count("image") < 1)
+    if ((vm.count("image") < 1) && (vm.count("images-from") < 1) && (vm.count("images-from-tar") < 1))
     {
       throw po::validation_error(po::validation_error::at_least_one_value_required,
 				 "image");
     }
 
+    // In batch mode, all positional arguments after the command are
+    // images, so filenames and patterns can only be given by option.
+    if (batch)
+    {
+      if (vm.count("image"))
+      {
+	image_fns.push_back(disk_image_fn);
+      }
+      image_fns.insert(image_fns.end(), pattern_strings.begin(), pattern_strings.end());
+      pattern_strings = std::move(option_pattern_strings);
+    }
+    else
+    {
+      pattern_strings.insert(pattern_strings.end(),
+			     option_pattern_strings.begin(),
+			     option_pattern_strings.end());
+    }
+
+    // images in an archive can't be written back
+    if ((vm.count("images-from-tar") > 0) &&
+	(command != Command::LS) &&
+	(command != Command::EXTRACT) &&
+	(command != Command::FREE))
+    {
+      throw po::validation_error(po::validation_error::invalid_option, "images-from-tar");
+    }
+
     switch (command)
     {
     case Command::LS:
@@ -446,14 +1977,68 @@ int main(int argc, char *argv[])
     case Command::CREATE:
       break;
     case Command::FREE:
-      if (vm.count("filename") > 0)
+      if (! pattern_strings.empty())
+      {
+	throw po::validation_error(po::validation_error::invalid_option);
+      }
+      break;
+    case Command::IMPORT:
+      if (batch)
+      {
+	throw po::validation_error(po::validation_error::invalid_option, "batch");
+      }
+      if (! pattern_strings.empty())
       {
 	throw po::validation_error(po::validation_error::invalid_option);
       }
       break;
+    case Command::EXPORT:
+      if (batch)
+      {
+	throw po::validation_error(po::validation_error::invalid_option, "batch");
+      }
+      break;
+    case Command::CP:
+    case Command::SYNC:
+      if (batch)
+      {
+	throw po::validation_error(po::validation_error::invalid_option, "batch");
+      }
+      if (pattern_strings.empty())
+      {
+	throw po::validation_error(po::validation_error::at_least_one_value_required,
+				   "filename");
+      }
+      break;
+    case Command::DIFF:
+    case Command::PATCH:
+      // the second image, or the patch file
+      if (batch)
+      {
+	throw po::validation_error(po::validation_error::invalid_option, "batch");
+      }
+      if (pattern_strings.size() != 1)
+      {
+	throw po::validation_error(pattern_strings.empty() ?
+				   po::validation_error::at_least_one_value_required :
+				   po::validation_error::multiple_values_not_allowed,
+				   "filename");
+      }
+      break;
+    case Command::SESSION:
+      if (batch)
+      {
+	throw po::validation_error(po::validation_error::invalid_option, "batch");
+      }
+      if (pattern_strings.size() > 1)
+      {
+	throw po::validation_error(po::validation_error::multiple_values_not_allowed,
+				   "filename");
+      }
+      break;
     case Command::INSERT:
     case Command::RM:
-      if (vm.count("filename") < 1)
+      if (pattern_strings.empty())
       {
 	throw po::validation_error(po::validation_error::at_least_one_value_required,
 				   "filename");
@@ -467,19 +2052,237 @@ int main(int argc, char *argv[])
     std::exit(1);
   }
 
+  if (command == Command::SESSION)
+  {
+    // the only argument, if any, is a host filename for the script
+    std::string script_fn = pattern_strings.empty() ? "" : pattern_strings[0];
+    utility::OutputSink out(options.output_format, &std::cout);
+    try
+    {
+      session(options, disk_image_fn, script_fn, out, std::cerr);
+    }
+    catch (const std::exception& e)
+    {
+      out.flush();
+      std::cerr << std::format("error: {}\n", e.what());
+      return 1;
+    }
+    return 0;
+  }
+
+  // Like diff(1), diff exits with 0 if the images are the same, 1 if
+  // they differ, and 2 on error.
+  if ((command == Command::DIFF) || (command == Command::PATCH))
+  {
+    utility::OutputSink out(options.output_format, &std::cout);
+    try
+    {
+      if (command == Command::DIFF)
+      {
+	return diff(options.disk_image_format, disk_image_fn, pattern_strings[0], patch_fn, out) ? 1 : 0;
+      }
+      patch(options.disk_image_format, disk_image_fn, pattern_strings[0], options.save_mode, out);
+    }
+    catch (const std::exception& e)
+    {
+      out.flush();
+      std::cerr << std::format("error: {}\n", e.what());
+      return (command == Command::DIFF) ? 2 : 1;
+    }
+    return 0;
+  }
+
+  if (command == Command::SYNC)
+  {
+    // The host directory is followed by the image, then any patterns.
+    std::string host_dir = disk_image_fn;
+    std::string image_fn = pattern_strings[0];
+    pattern_strings.erase(pattern_strings.begin());
+    utility::OutputSink out(options.output_format, &std::cout);
+    try
+    {
+      for (const std::string& pattern_string: pattern_strings)
+      {
+	options.patterns.emplace_back(pattern_string);
+      }
+      sync(options.disk_image_format,
+	   host_dir,
+	   image_fn,
+	   options.patterns,
+	   options.save_mode,
+	   options.allocation_policy,
+	   options.conversion,
+	   out);
+    }
+    catch (const std::exception& e)
+    {
+      out.flush();
+      std::cerr << std::format("error: {}\n", e.what());
+      return 1;
+    }
+    return 0;
+  }
+
+  if (command == Command::CP)
+  {
+    // The source is given as IMAGE:PATTERN, or just IMAGE for all
+    // files. A colon followed by a path isn't a pattern, but part of
+    // a Windows drive name. The destination image is followed by any
+    // patterns given by option.
+    std::string source_image_fn = disk_image_fn;
+    std::string dest_image_fn = pattern_strings[0];
+    pattern_strings.erase(pattern_strings.begin());
+    std::size_t colon = source_image_fn.rfind(':');
+    if ((colon != std::string::npos) &&
+	(source_image_fn.find_first_of("/\\", colon) == std::string::npos))
+    {
+      pattern_strings.push_back(source_image_fn.substr(colon + 1));
+      source_image_fn.erase(colon);
+    }
+    utility::OutputSink out(options.output_format, &std::cout);
+    try
+    {
+      for (const std::string& pattern_string: pattern_strings)
+      {
+	options.patterns.emplace_back(pattern_string);
+      }
+      cp(options.disk_image_format,
+	 source_image_fn,
+	 options.patterns,
+	 dest_image_fn,
+	 options.save_mode,
+	 options.allocation_policy,
+	 options.replace_existing,
+	 out);
+    }
+    catch (const std::exception& e)
+    {
+      out.flush();
+      std::cerr << std::format("error: {}\n", e.what());
+      return 1;
+    }
+    return 0;
+  }
+
   for (const std::string& pattern_string: pattern_strings)
   {
-    patterns.emplace_back(pattern_string);
+    options.patterns.emplace_back(pattern_string);
   }
 
-  switch (command)
+  if (batch)
+  {
+    // images named on the command line, if any, then those listed in
+    // the images-from file, or the members of the images-from-tar
+    // archive
+    std::size_t next_image_index = 0;
+    std::ifstream images_from_file;
+    std::istream* images_from_stream = nullptr;
+    std::optional<utility::HostFile> tar_file;
+    std::optional<utility::TarReader> tar;
+    auto next_image_fn = [&](BatchImage& image)
+    {
+      if (next_image_index < image_fns.size())
+      {
+	image.name = image_fns[next_image_index++];
+	return true;
+      }
+      while (images_from_stream && std::getline(*images_from_stream, image.name))
+      {
+	if ((! image.name.empty()) && (image.name.back() == '\r'))
+	{
+	  image.name.pop_back();
+	}
+	if (! image.name.empty())
+	{
+	  return true;
+	}
+      }
+      utility::TarMember member;
+      if (tar && tar->next(member))
+      {
+	// Only the part of the member that can make up the image is kept.
+	// Deflate never expands an image by more than a small fraction,
+	// so twice the image size is ample for a compressed one; one that
+	// needs more fails to load as too short. A compressed member is
+	// recognized by its magic number, as load() does, whatever its
+	// name.
+	std::array<std::uint8_t, 2> magic;
+	std::size_t magic_size = tar->read({ std::span<std::uint8_t>(magic) });
+	std::size_t size = AppleII::DiskImage::get_bytes_per_disk(options.disk_image_format);
+	if (AppleII::DiskImage::is_compressed(std::span<const std::uint8_t>(magic.data(), magic_size)))
+	{
+	  size *= 2;
+	}
+	size = std::min<std::uintmax_t>(size, member.size);
+	image.name = member.name;
+	image.data.emplace(size);
+	std::copy(magic.begin(), magic.begin() + magic_size, image.data->begin());
+	tar->read({ std::span<std::uint8_t>(*image.data).subspan(magic_size) });
+	return true;
+      }
+      return false;
+    };
+
+    try
+    {
+      if (images_from == "-")
+      {
+	images_from_stream = &std::cin;
+      }
+      else if (! images_from.empty())
+      {
+	images_from_file.open(images_from);
+	if (! images_from_file.is_open())
+	{
+	  throw std::runtime_error(std::format("unable to open image list \"{}\" to read", images_from));
+	}
+	images_from_stream = &images_from_file;
+      }
+      if (images_from_tar == "-")
+      {
+	tar_file.emplace(utility::HostFile::Mode::READ);
+      }
+      else if (! images_from_tar.empty())
+      {
+	tar_file.emplace(images_from_tar, utility::HostFile::Mode::READ);
+      }
+      if (tar_file)
+      {
+	tar.emplace(*tar_file);
+      }
+      std::size_t failure_count = run_batch(command, options, next_image_fn, job_count);
+      return (failure_count == 0) ? 0 : 1;
+    }
+    catch (const std::exception& e)
+    {
+      std::cerr << std::format("error: {}\n", e.what());
+      return 1;
+    }
+  }
+
+  // A single image can still keep several host files being written
+  // at once.
+  std::optional<utility::WorkerPool> extract_pool;
+  if (command == Command::EXTRACT)
+  {
+    extract_pool.emplace(job_count);
+  }
+  utility::OutputSink out(options.output_format, report_stream);
+  try
+  {
+    run_command(command,
+		options,
+		disk_image_fn,
+		std::filesystem::path(),
+		extract_pool ? &*extract_pool : nullptr,
+		out,
+		std::cerr);
+  }
+  catch (const std::exception& e)
   {
-  case Command::LS:      ls     (disk_image_format, disk_image_fn, patterns); break;
-  case Command::EXTRACT: extract(disk_image_format, disk_image_fn, patterns); break;
-  case Command::INSERT:  insert (disk_image_format, disk_image_fn, patterns); break;
-  case Command::CREATE:  create (disk_image_format, disk_image_fn, patterns); break;
-  case Command::RM:      rm     (disk_image_format, disk_image_fn, patterns); break;
-  case Command::FREE:    free   (disk_image_format, disk_image_fn);           break;
+    out.flush();
+    std::cerr << std::format("error: {}\n", e.what());
+    return 1;
   }
 
   return 0;
@@ -0,0 +1,365 @@
+// tar_archive.cc
+//
+// Copyright 2025 Eric Smith
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <algorithm>
+#include <format>
+#include <string_view>
+
+#include "tar_archive.hh"
+
+namespace utility
+{
+  TarError::TarError(const std::string& what):
+    std::runtime_error(what)
+  {
+  }
+
+  // ustar header field offsets and sizes
+  enum TarHeaderField
+  {
+    NAME     = 0,    NAME_SIZE     = 100,
+    MODE     = 100,  MODE_SIZE     = 8,
+    UID      = 108,  UID_SIZE      = 8,
+    GID      = 116,  GID_SIZE      = 8,
+    SIZE     = 124,  SIZE_SIZE     = 12,
+    MTIME    = 136,  MTIME_SIZE    = 12,
+    CHECKSUM = 148,  CHECKSUM_SIZE = 8,
+    TYPEFLAG = 156,
+    MAGIC    = 257,  MAGIC_SIZE    = 6,
+    VERSION  = 263,  VERSION_SIZE  = 2,
+    PREFIX   = 345,  PREFIX_SIZE   = 155,
+  };
+
+  static constexpr std::array<std::uint8_t, 2 * TAR_BLOCK_SIZE> zero_blocks {};
+
+  // far more than any real pax header or long name needs
+  static constexpr std::uintmax_t max_extended_header_size = 1 << 20;
+
+  // octal, zero filled, NUL terminated
+  static void put_octal(std::span<std::uint8_t> field,
+			std::uintmax_t value,
+			const char* what)
+  {
+    std::size_t digits = field.size() - 1;
+    for (std::size_t i = digits; i-- > 0; )
+    {
+      field[i] = '0' + (value & 7);
+      value >>= 3;
+    }
+    if (value)
+    {
+      throw TarError(std::format("tar header {} too large", what));
+    }
+    field[digits] = '\0';
+  }
+
+  // Octal, terminated by NUL or space, possibly with leading spaces.
+  // Also accepts the base-256 form that GNU tar uses for values too
+  // large for octal.
+  static std::uintmax_t get_number(std::span<const std::uint8_t> field,
+				    const char* what)
+  {
+    std::uintmax_t value = 0;
+    if (field[0] & 0x80)
+    {
+      if (field[0] != 0x80)
+      {
+	throw TarError(std::format("tar header {} out of range", what));
+      }
+      for (std::uint8_t b: field.subspan(1))
+      {
+	if (value >> (8 * sizeof(value) - 8))
+	{
+	  throw TarError(std::format("tar header {} out of range", what));
+	}
+	value = (value << 8) | b;
+      }
+      return value;
+    }
+    std::size_t i = 0;
+    while ((i < field.size()) && (field[i] == ' '))
+    {
+      ++i;
+    }
+    for (; (i < field.size()) && (field[i] != '\0') && (field[i] != ' '); i++)
+    {
+      if ((field[i] < '0') || (field[i] > '7') || (value >> (8 * sizeof(value) - 3)))
+      {
+	throw TarError(std::format("tar header {} invalid", what));
+      }
+      value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+  }
+
+  static std::string get_string(std::span<const std::uint8_t> field)
+  {
+    auto end = std::find(field.begin(), field.end(), 0);
+    return std::string(field.begin(), end);
+  }
+
+  TarWriter::TarWriter(HostFile& out):
+    m_out(out)
+  {
+  }
+
+  TarWriter::Block TarWriter::make_header(const TarMember& member)
+  {
+    Block header {};
+    std::span<std::uint8_t> h(header);
+
+    if (member.name.empty() || (member.name.size() > NAME_SIZE))
+    {
+      throw TarError(std::format("tar member name \"{}\" invalid", member.name));
+    }
+    std::copy(member.name.begin(), member.name.end(), header.begin() + NAME);
+    put_octal(h.subspan(MODE,  MODE_SIZE),  0644, "mode");
+    put_octal(h.subspan(UID,   UID_SIZE),   0, "uid");
+    put_octal(h.subspan(GID,   GID_SIZE),   0, "gid");
+    put_octal(h.subspan(SIZE,  SIZE_SIZE),  member.size, "size");
+    put_octal(h.subspan(MTIME, MTIME_SIZE), std::max<std::int64_t>(member.mtime, 0), "mtime");
+    header[TYPEFLAG] = '0';
+    std::copy_n("ustar", MAGIC_SIZE, header.begin() + MAGIC);
+    std::copy_n("00", VERSION_SIZE, header.begin() + VERSION);
+
+    // checksum is computed with its own field filled with spaces
+    std::fill_n(header.begin() + CHECKSUM, CHECKSUM_SIZE, ' ');
+    unsigned checksum = 0;
+    for (std::uint8_t b: header)
+    {
+      checksum += b;
+    }
+    put_octal(h.subspan(CHECKSUM, CHECKSUM_SIZE - 1), checksum, "checksum");
+    return header;
+  }
+
+  std::span<const std::uint8_t> TarWriter::padding(std::uintmax_t size)
+  {
+    std::size_t partial = size % TAR_BLOCK_SIZE;
+    return std::span<const std::uint8_t>(zero_blocks.data(), partial ? (TAR_BLOCK_SIZE - partial) : 0);
+  }
+
+  void TarWriter::add_file(const TarMember& member,
+			   const std::vector<std::span<const std::uint8_t>>& data)
+  {
+    Block header = make_header(member);
+    std::vector<std::span<const std::uint8_t>> spans;
+    spans.reserve(data.size() + 2);
+    spans.push_back(header);
+    spans.insert(spans.end(), data.begin(), data.end());
+    spans.push_back(padding(member.size));
+    m_out.write(spans);
+  }
+
+  void TarWriter::add_file(const TarMember& member,
+			   const HostFile& source,
+			   std::uintmax_t offset)
+  {
+    Block header = make_header(member);
+    m_out.write({ std::span<const std::uint8_t>(header) });
+    m_out.copy_from(source, offset, member.size);
+    m_out.write({ padding(member.size) });
+  }
+
+  void TarWriter::finish()
+  {
+    m_out.write({ std::span<const std::uint8_t>(zero_blocks) });
+  }
+
+  TarReader::TarReader(HostFile& in):
+    m_in(in),
+    m_remaining(0),
+    m_padding(0)
+  {
+  }
+
+  bool TarReader::next(TarMember& member)
+  {
+    while (true)
+    {
+      skip(m_remaining + m_padding);
+      m_remaining = 0;
+      m_padding = 0;
+
+      Block header;
+      std::size_t count = m_in.read({ std::span<std::uint8_t>(header) });
+      if (count == 0)
+      {
+	return false;  // archive without end marker
+      }
+      if (count != header.size())
+      {
+	throw TarError("tar archive truncated in header");
+      }
+      if (std::all_of(header.begin(), header.end(), [](std::uint8_t b) { return b == 0; }))
+      {
+	return false;  // end of archive marker
+      }
+
+      std::span<const std::uint8_t> h(header);
+      unsigned checksum = 0;
+      for (std::size_t i = 0; i < header.size(); i++)
+      {
+	bool in_checksum = (i >= CHECKSUM) && (i < CHECKSUM + CHECKSUM_SIZE);
+	checksum += in_checksum ? ' ' : header[i];
+      }
+      if (get_number(h.subspan(CHECKSUM, CHECKSUM_SIZE), "checksum") != checksum)
+      {
+	throw TarError("tar header checksum mismatch");
+      }
+
+      std::uintmax_t size = get_number(h.subspan(SIZE, SIZE_SIZE), "size");
+      std::size_t partial = size % TAR_BLOCK_SIZE;
+      m_remaining = size;
+      m_padding = partial ? (TAR_BLOCK_SIZE - partial) : 0;
+
+      std::uint8_t type = header[TYPEFLAG];
+      if ((type == 'x') || (type == 'g'))
+      {
+	// pax extended header, for the next member or (g) all of them
+	std::string path = pax_path(read_extended_header());
+	if (type == 'g')
+	{
+	  if (! path.empty())
+	  {
+	    throw TarError("tar global pax header with a path isn't supported");
+	  }
+	}
+	else if (! path.empty())
+	{
+	  m_long_name = path;
+	}
+	continue;
+      }
+      if (type == 'L')
+      {
+	// GNU long name, for the next member
+	std::string name = read_extended_header();
+	m_long_name = name.substr(0, name.find('\0'));
+	continue;
+      }
+      if ((type != '0') && (type != '\0') && (type != '7'))
+      {
+	m_long_name.clear();
+	continue;
+      }
+
+      member.name = get_string(h.subspan(NAME, NAME_SIZE));
+      if (! m_long_name.empty())
+      {
+	member.name = std::move(m_long_name);
+	m_long_name.clear();
+      }
+      else if (std::equal(header.begin() + MAGIC, header.begin() + MAGIC + 5, "ustar"))
+      {
+	std::string prefix = get_string(h.subspan(PREFIX, PREFIX_SIZE));
+	if (! prefix.empty())
+	{
+	  member.name = prefix + "/" + member.name;
+	}
+      }
+      member.size = size;
+      member.mtime = get_number(h.subspan(MTIME, MTIME_SIZE), "mtime");
+      return true;
+    }
+  }
+
+  std::size_t TarReader::read(const std::vector<std::span<std::uint8_t>>& spans)
+  {
+    // The padding is read along with the data when the whole member
+    // is requested, to save a system call.
+    m_spans.clear();
+    std::uintmax_t wanted = 0;
+    for (std::span<std::uint8_t> span: spans)
+    {
+      if (wanted == m_remaining)
+      {
+	break;
+      }
+      std::size_t size = std::min<std::uintmax_t>(span.size(), m_remaining - wanted);
+      m_spans.push_back(span.first(size));
+      wanted += size;
+    }
+    bool with_padding = (wanted == m_remaining) && m_padding;
+    if (with_padding)
+    {
+      m_spans.push_back(std::span<std::uint8_t>(m_scratch.data(), m_padding));
+    }
+
+    std::size_t count = m_in.read(m_spans);
+    if (count != wanted + (with_padding ? m_padding : 0))
+    {
+      throw TarError("tar archive truncated in member data");
+    }
+    m_remaining -= wanted;
+    if (with_padding)
+    {
+      m_padding = 0;
+    }
+    return wanted;
+  }
+
+  // the data of the current member, which is an extended header
+  std::string TarReader::read_extended_header()
+  {
+    if (m_remaining > max_extended_header_size)
+    {
+      throw TarError("tar extended header too large");
+    }
+    std::string data(m_remaining, '\0');
+    read({ std::span<std::uint8_t>(reinterpret_cast<std::uint8_t*>(data.data()), data.size()) });
+    return data;
+  }
+
+  // The path from pax extended header records, each of the form
+  // "length key=value\n", or an empty string if there is none.
+  std::string TarReader::pax_path(const std::string& records)
+  {
+    std::string path;
+    std::size_t pos = 0;
+    while (pos < records.size())
+    {
+      std::size_t space = records.find(' ', pos);
+      std::size_t length = 0;
+      for (std::size_t i = pos; i < std::min(space, records.size()); i++)
+      {
+	if ((records[i] < '0') || (records[i] > '9') || (length > records.size()))
+	{
+	  throw TarError("tar pax header invalid");
+	}
+	length = length * 10 + (records[i] - '0');
+      }
+      if ((space == std::string::npos) ||
+	  (length <= space - pos) ||
+	  (length > records.size() - pos) ||
+	  (records[pos + length - 1] != '\n'))
+      {
+	throw TarError("tar pax header invalid");
+      }
+      std::string_view record(records.data() + space + 1, pos + length - 1 - (space + 1));
+      std::size_t equals = record.find('=');
+      if ((equals != std::string_view::npos) && (record.substr(0, equals) == "path"))
+      {
+	path = record.substr(equals + 1);
+      }
+      pos += length;
+    }
+    return path;
+  }
+
+  void TarReader::skip(std::uintmax_t size)
+  {
+    while (size)
+    {
+      std::size_t chunk = std::min<std::uintmax_t>(size, m_scratch.size());
+      if (m_in.read({ std::span<std::uint8_t>(m_scratch.data(), chunk) }) != chunk)
+      {
+	throw TarError("tar archive truncated in member data");
+      }
+      size -= chunk;
+    }
+  }
+
+} // end namespace utility
@@ -0,0 +1,105 @@
+// tar_archive.hh
+//
+// Copyright 2025 Eric Smith
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef TAR_ARCHIVE_HH
+#define TAR_ARCHIVE_HH
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "host_file.hh"
+
+namespace utility
+{
+  struct TarError: public std::runtime_error
+  { TarError(const std::string& what); };
+
+  static constexpr std::size_t TAR_BLOCK_SIZE = 512;
+
+  struct TarMember
+  {
+    std::string name;
+    std::uintmax_t size;
+    std::int64_t mtime;  // seconds since the Unix epoch
+  };
+
+  // Writes a POSIX ustar archive of regular files, in a single pass,
+  // so that it can go to a pipe.
+  class TarWriter
+  {
+  public:
+    TarWriter(HostFile& out);
+
+    TarWriter(const TarWriter&) = delete;
+    TarWriter& operator=(const TarWriter&) = delete;
+
+    // The header, the data gathered from spans, and the padding to a
+    // whole block are written together. The spans must total
+    // member.size bytes.
+    void add_file(const TarMember& member,
+		  const std::vector<std::span<const std::uint8_t>>& data);
+
+    // data copied from source, starting at offset
+    void add_file(const TarMember& member,
+		  const HostFile& source,
+		  std::uintmax_t offset);
+
+    // end of archive marker
+    void finish();
+
+  private:
+    using Block = std::array<std::uint8_t, TAR_BLOCK_SIZE>;
+
+    static Block make_header(const TarMember& member);
+    static std::span<const std::uint8_t> padding(std::uintmax_t size);
+
+    HostFile& m_out;
+  };
+
+  // Reads a tar archive in a single pass, so that it can come from a
+  // pipe. Only regular files are returned; other members, such as
+  // directories, are skipped. A name longer than a ustar header holds,
+  // from a pax extended header or a GNU long name member, is applied to
+  // the member that follows it.
+  class TarReader
+  {
+  public:
+    TarReader(HostFile& in);
+
+    TarReader(const TarReader&) = delete;
+    TarReader& operator=(const TarReader&) = delete;
+
+    // Advance to the next regular file, skipping any of the current
+    // member's data that wasn't read. Returns false at the end of the
+    // archive.
+    bool next(TarMember& member);
+
+    // Scatter read of the current member's data into the spans, in
+    // order, up to the end of the member. Returns the number of bytes
+    // read.
+    std::size_t read(const std::vector<std::span<std::uint8_t>>& spans);
+
+  private:
+    using Block = std::array<std::uint8_t, TAR_BLOCK_SIZE>;
+
+    void skip(std::uintmax_t size);
+    std::string read_extended_header();
+    static std::string pax_path(const std::string& records);
+
+    HostFile& m_in;
+    std::string m_long_name;     // for the next member, if not empty
+    std::uintmax_t m_remaining;  // data of the current member not yet read
+    std::uintmax_t m_padding;    // padding following the current member
+    std::vector<std::span<std::uint8_t>> m_spans;
+    Block m_scratch;
+  };
+
+} // end namespace utility
+
+#endif // TAR_ARCHIVE_HH
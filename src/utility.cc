@@ -4,6 +4,19 @@
 // SPDX-License-Identifier: GPL-3.0-only
 
 #include <algorithm>
+#include <cerrno>
+#include <format>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "utility.hh"
 
@@ -98,4 +111,75 @@ namespace utility
     return result;
   }
 
+  std::filesystem::path create_temp_file(const std::filesystem::path& filename)
+  {
+    std::string temp_name = filename.string() + ".summit-XXXXXX";
+#ifdef _WIN32
+    int fd = -1;
+    if (_mktemp_s(temp_name.data(), temp_name.size() + 1) == 0)
+    {
+      fd = _open(temp_name.c_str(), _O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY, _S_IREAD | _S_IWRITE);
+    }
+    if (fd < 0)
+    {
+      throw std::runtime_error(std::format("unable to create temporary file for \"{}\"", filename.string()));
+    }
+    _close(fd);
+#else
+    int fd = mkstemp(temp_name.data());
+    if (fd < 0)
+    {
+      throw std::runtime_error(std::format("unable to create temporary file for \"{}\"", filename.string()));
+    }
+    struct stat st;
+    mode_t mode;
+    if (::stat(filename.c_str(), &st) == 0)
+    {
+      mode = st.st_mode & 07777;
+    }
+    else
+    {
+      mode_t mask = umask(0);
+      umask(mask);
+      mode = 0666 & ~mask;
+    }
+    bool ok = fchmod(fd, mode) == 0;
+    ok = (::close(fd) == 0) && ok;
+    if (! ok)
+    {
+      ::unlink(temp_name.c_str());
+      throw std::runtime_error(std::format("unable to create temporary file for \"{}\"", filename.string()));
+    }
+#endif
+    return temp_name;
+  }
+
+  void sync_to_storage(const std::filesystem::path& path, bool directory)
+  {
+#ifdef _WIN32
+    if (directory)
+    {
+      return;  // not possible, and renames are journaled by NTFS
+    }
+    int fd = _open(path.string().c_str(), _O_WRONLY | _O_BINARY);
+    bool ok = (fd >= 0) && (_commit(fd) == 0);
+    if (fd >= 0)
+    {
+      _close(fd);
+    }
+#else
+    int fd = ::open(path.c_str(), directory ? O_RDONLY : O_WRONLY);
+    // some file systems can't sync a directory, and say so with EINVAL
+    bool ok = (fd >= 0) && ((fsync(fd) == 0) || (directory && (errno == EINVAL)));
+    if (fd >= 0)
+    {
+      ::close(fd);
+    }
+#endif
+    if (! ok)
+    {
+      throw std::runtime_error(std::format("unable to sync \"{}\" to storage", path.string()));
+    }
+  }
+
 } // end namespace utility
@@ -6,6 +6,7 @@
 #ifndef UTILITY_HH
 #define UTILITY_HH
 
+#include <filesystem>
 #include <string>
 
 namespace utility
@@ -22,6 +23,15 @@ namespace utility
   std::string upcase_string(const std::string& s);
   std::string downcase_string(const std::string& s);
 
+  // Create a new, empty file in the same directory as filename, with a
+  // unique name, to be renamed over it. It gets the permissions of
+  // filename if that exists.
+  std::filesystem::path create_temp_file(const std::filesystem::path& filename);
+
+  // Make sure that the contents of a file, or a directory's entries,
+  // have reached storage.
+  void sync_to_storage(const std::filesystem::path& path, bool directory);
+
 } // end namespace utility
 
 #endif // UTILITY_HH
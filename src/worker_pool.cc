@@ -0,0 +1,71 @@
+// worker_pool.cc
+//
+// Copyright 2025 Eric Smith
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <algorithm>
+
+#include "worker_pool.hh"
+
+namespace utility
+{
+  WorkerPool::WorkerPool(unsigned thread_count):
+    m_stopping(false)
+  {
+    if (thread_count == 0)
+    {
+      thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 0; i < thread_count; i++)
+    {
+      m_threads.emplace_back(&WorkerPool::run, this);
+    }
+  }
+
+  WorkerPool::~WorkerPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+    m_task_available.notify_all();
+    for (std::thread& thread: m_threads)
+    {
+      thread.join();
+    }
+  }
+
+  unsigned WorkerPool::get_thread_count() const
+  {
+    return m_threads.size();
+  }
+
+  void WorkerPool::enqueue(std::function<void()> task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_tasks.push_back(std::move(task));
+    }
+    m_task_available.notify_one();
+  }
+
+  void WorkerPool::run()
+  {
+    while (true)
+    {
+      std::function<void()> task;
+      {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_task_available.wait(lock, [this]() { return m_stopping || ! m_tasks.empty(); });
+	if (m_tasks.empty())
+	{
+	  return;
+	}
+	task = std::move(m_tasks.front());
+	m_tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+} // end namespace utility
@@ -0,0 +1,60 @@
+// worker_pool.hh
+//
+// Copyright 2025 Eric Smith
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef WORKER_POOL_HH
+#define WORKER_POOL_HH
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace utility
+{
+  // Fixed set of worker threads running submitted tasks in submission
+  // order. Destroying the pool finishes any tasks already submitted.
+  class WorkerPool
+  {
+  public:
+    // thread_count of zero uses one thread per hardware thread
+    WorkerPool(unsigned thread_count = 0);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    unsigned get_thread_count() const;
+
+    // The returned future yields the task's result, or rethrows any
+    // exception the task threw.
+    template <typename Task>
+    std::future<std::invoke_result_t<Task>> submit(Task&& task)
+    {
+      using Result = std::invoke_result_t<Task>;
+      auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<Task>(task));
+      std::future<Result> result = packaged->get_future();
+      enqueue([packaged]() { (*packaged)(); });
+      return result;
+    }
+
+  private:
+    void enqueue(std::function<void()> task);
+    void run();
+
+    std::mutex m_mutex;
+    std::condition_variable m_task_available;
+    std::deque<std::function<void()>> m_tasks;
+    bool m_stopping;
+    std::vector<std::thread> m_threads;
+  };
+
+} // end namespace utility
+
+#endif // WORKER_POOL_HH